@@ -1,18 +1,57 @@
 // search_server_s3_t3_v3.cpp
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <execution>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 const int MAX_RESULT_DOCUMENT_COUNT = 5;
+const double RELEVANCE_EPSILON = 1e-6;
+const size_t RELEVANCE_BUCKET_COUNT = 64;
+const size_t QUERY_CACHE_CAPACITY = 1000;
+// Stack memory for counting the words of a document being added
+const size_t INGEST_BUFFER_SIZE = 16 * 1024;
+// Shorter queries are matched sequentially even with the parallel policy
+const size_t PARALLEL_MATCH_MIN_WORD_COUNT = 32;
+// Documents that ProcessQueriesJoined reserves at once for the results of a chunk of queries
+const size_t JOINED_QUERIES_SLOT_SPACE = 64 * 1024;
 
 string ReadLine() {
     string s;
@@ -27,22 +66,146 @@ int ReadLineWithNumber() {
     return result;
 }
 
-vector<string> SplitIntoWords(const string& text) {
-    vector<string> words;
-    string word;
-    for (const char c : text) {
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profile_guard_, __LINE__)
+#define LOG_DURATION(name) LogDuration UNIQUE_VAR_NAME_PROFILE(name)
+#define LOG_DURATION_STREAM(name, stream) LogDuration UNIQUE_VAR_NAME_PROFILE(name, stream)
+
+// Server operations time themselves only in builds with SEARCH_SERVER_PROFILE
+#ifdef SEARCH_SERVER_PROFILE
+#define PROFILE_OPERATION(name) LOG_DURATION(name)
+#else
+#define PROFILE_OPERATION(name)
+#endif
+
+// Writes the time spent in its scope to the stream when the scope ends
+class LogDuration {
+public:
+    using Clock = chrono::steady_clock;
+    
+    explicit LogDuration(string_view name, ostream& out = cerr)
+            : name_(name)
+            , out_(out) {
+    }
+    
+    ~LogDuration() {
+        const auto duration = Clock::now() - start_time_;
+        out_ << name_ << ": "s << chrono::duration_cast<chrono::microseconds>(duration).count() << " us"s << endl;
+    }
+
+private:
+    const string name_;
+    ostream& out_;
+    const Clock::time_point start_time_ = Clock::now();
+};
+
+bool IsControlChar(char c) {
+    return c >= '\0' && c < ' ';
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#define SEARCH_SERVER_SIMD_SCAN
+#if defined(__AVX2__)
+const size_t SCAN_CHUNK_SIZE = 32;
+#else
+const size_t SCAN_CHUNK_SIZE = 16;
+#endif
+const uint32_t SCAN_CHUNK_MASK = SCAN_CHUNK_SIZE == 32 ? 0xFFFFFFFFu : 0xFFFFu;
+
+// Bit i of space_mask is set when chunk[i] is ' ', bit i of control_mask when chunk[i] is a control char
+void ScanChunk(const char* chunk, uint32_t& space_mask, uint32_t& control_mask) {
+#if defined(__AVX2__)
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk));
+    const __m256i spaces = _mm256_set1_epi8(' ');
+    const __m256i last_control = _mm256_set1_epi8(' ' - 1);
+    space_mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, spaces)));
+    // Unsigned min keeps bytes >= 0x80 out of the control range
+    control_mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, last_control), bytes)));
+#else
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk));
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i last_control = _mm_set1_epi8(' ' - 1);
+    space_mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, spaces)));
+    // Unsigned min keeps bytes >= 0x80 out of the control range
+    control_mask = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_min_epu8(bytes, last_control), bytes)));
+#endif
+}
+#endif
+
+// Calls handle_word(word, is_valid) for every space-separated word of text, where is_valid
+// tells whether the word has no control characters. Word boundaries and control characters
+// are found in a single pass, a whole SIMD chunk at a time when SSE2 or AVX2 is available.
+template <typename WordHandler>
+void ForEachWord(string_view text, WordHandler handle_word) {
+    const size_t no_word = string_view::npos;
+    size_t word_begin = no_word;
+    bool word_is_valid = true;
+    size_t pos = 0;
+#ifdef SEARCH_SERVER_SIMD_SCAN
+    for (; pos + SCAN_CHUNK_SIZE <= text.size(); pos += SCAN_CHUNK_SIZE) {
+        uint32_t space_mask;
+        uint32_t control_mask;
+        ScanChunk(text.data() + pos, space_mask, control_mask);
+        if (space_mask == 0 && word_begin != no_word) {
+            word_is_valid = word_is_valid && control_mask == 0;
+            continue;
+        }
+        uint32_t offset = 0;
+        while (offset < SCAN_CHUNK_SIZE) {
+            const uint32_t tail = (SCAN_CHUNK_MASK << offset) & SCAN_CHUNK_MASK;
+            if (word_begin == no_word) {
+                const uint32_t non_spaces = ~space_mask & tail;
+                if (non_spaces == 0) {
+                    break;
+                }
+                offset = __builtin_ctz(non_spaces);
+                word_begin = pos + offset;
+                word_is_valid = true;
+                continue;
+            }
+            const uint32_t spaces = space_mask & tail;
+            if (spaces == 0) {
+                word_is_valid = word_is_valid && (control_mask & tail) == 0;
+                break;
+            }
+            const uint32_t word_end = __builtin_ctz(spaces);
+            const uint32_t word_bits = tail & ((1u << word_end) - 1);
+            word_is_valid = word_is_valid && (control_mask & word_bits) == 0;
+            handle_word(text.substr(word_begin, pos + word_end - word_begin), word_is_valid);
+            word_begin = no_word;
+            offset = word_end;
+        }
+    }
+#endif
+    for (; pos < text.size(); ++pos) {
+        const char c = text[pos];
         if (c == ' ') {
-            if (!word.empty()) {
-                words.push_back(word);
-                word.clear();
+            if (word_begin != no_word) {
+                handle_word(text.substr(word_begin, pos - word_begin), word_is_valid);
+                word_begin = no_word;
             }
-        } else {
-            word += c;
+            continue;
         }
+        if (word_begin == no_word) {
+            word_begin = pos;
+            word_is_valid = true;
+        }
+        word_is_valid = word_is_valid && !IsControlChar(c);
     }
-    if (!word.empty()) {
-        words.push_back(word);
+    if (word_begin != no_word) {
+        handle_word(text.substr(word_begin), word_is_valid);
     }
+}
+
+// Returned words point into text, so text must outlive them
+vector<string_view> SplitIntoWords(string_view text) {
+    vector<string_view> words;
+    ForEachWord(text, [&words](string_view word, bool) {
+        words.push_back(word);
+    });
     
     return words;
 }
@@ -61,239 +224,2461 @@ struct Document {
     int rating = 0;
 };
 
+struct QueryCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// LRU cache of search results, safe to use from concurrent queries
+class QueryCache {
+public:
+    explicit QueryCache(size_t capacity)
+            : capacity_(capacity) {
+    }
+    
+    // Cached results and statistics belong to the index they were built for and are not copied
+    QueryCache(const QueryCache& other)
+            : capacity_(other.GetCapacity()) {
+    }
+    
+    size_t GetCapacity() const {
+        lock_guard guard(guard_);
+        return capacity_;
+    }
+    
+    void SetCapacity(size_t capacity) {
+        lock_guard guard(guard_);
+        capacity_ = capacity;
+        while (entries_.size() > capacity_) {
+            EvictLeastRecentlyUsed();
+        }
+    }
+    
+    optional<vector<Document>> Find(const string& key) {
+        lock_guard guard(guard_);
+        const auto it = key_to_entry_.find(key);
+        if (it == key_to_entry_.end()) {
+            ++stats_.misses;
+            return nullopt;
+        }
+        ++stats_.hits;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->second;
+    }
+    
+    void Insert(string key, vector<Document> documents) {
+        lock_guard guard(guard_);
+        if (capacity_ == 0 || key_to_entry_.count(key) > 0) {
+            return;
+        }
+        if (entries_.size() == capacity_) {
+            EvictLeastRecentlyUsed();
+        }
+        entries_.emplace_front(move(key), move(documents));
+        key_to_entry_.emplace(entries_.front().first, entries_.begin());
+    }
+    
+    void Clear() {
+        lock_guard guard(guard_);
+        key_to_entry_.clear();
+        entries_.clear();
+    }
+    
+    QueryCacheStats GetStats() const {
+        lock_guard guard(guard_);
+        return stats_;
+    }
+
+private:
+    using Entry = pair<string, vector<Document>>;
+    
+    mutable mutex guard_;
+    size_t capacity_;
+    // The most recently used entry goes first
+    list<Entry> entries_;
+    unordered_map<string_view, list<Entry>::iterator> key_to_entry_;
+    QueryCacheStats stats_;
+    
+    void EvictLeastRecentlyUsed() {
+        key_to_entry_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+};
+
 template <typename StringContainer>
-set<string> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
-    set<string> non_empty_strings;
-    for (const string& str : strings) {
+set<string, less<>> MakeUniqueNonEmptyStrings(const StringContainer& strings) {
+    set<string, less<>> non_empty_strings;
+    for (const auto& str : strings) {
         if (!str.empty()) {
-            non_empty_strings.insert(str);
+            non_empty_strings.emplace(str);
         }
     }
     return non_empty_strings;
 }
 
-enum class DocumentStatus {
-    ACTUAL,
-    IRRELEVANT,
-    BANNED,
-    REMOVED,
+// Per-stage query statistics are collected only when SEARCH_SERVER_STATS is defined;
+// otherwise the recorder below is empty and every call to it compiles to nothing
+enum class QueryStage {
+    PARSE,
+    MINUS_WORDS,
+    SCORING,
+    SELECTION,
 };
 
-class SearchServer {
+const size_t QUERY_STAGE_COUNT = 4;
+
+string_view GetQueryStageName(QueryStage stage) {
+    switch (stage) {
+        case QueryStage::PARSE:
+            return "parse"sv;
+        case QueryStage::MINUS_WORDS:
+            return "minus_words"sv;
+        case QueryStage::SCORING:
+            return "scoring"sv;
+        case QueryStage::SELECTION:
+            return "selection"sv;
+    }
+    return "unknown"sv;
+}
+
+// Bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i)
+struct HistogramSnapshot {
+    static constexpr size_t BUCKET_COUNT = 65;
+    
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    array<uint64_t, BUCKET_COUNT> buckets{};
+    
+    static size_t GetBucket(uint64_t value) {
+        size_t bucket = 0;
+        while (bucket < 64 && (value >> bucket) != 0) {
+            ++bucket;
+        }
+        return bucket;
+    }
+    
+    static uint64_t GetBucketUpperBound(size_t bucket) {
+        return bucket == 64 ? numeric_limits<uint64_t>::max() : (uint64_t{1} << bucket) - 1;
+    }
+};
+
+struct QueryStatsSnapshot {
+    array<HistogramSnapshot, QUERY_STAGE_COUNT> stage_nanoseconds;
+    // Postings of plus words scanned or looked up by one query
+    HistogramSnapshot postings_visited;
+    // Documents that got a relevance in one query, before the best ones are selected
+    HistogramSnapshot matched_documents;
+    
+    // One line per histogram: count, sum and the non-empty buckets as "<=upper_bound:count"
+    void WriteText(ostream& out) const {
+        const auto write_histogram = [&out](string_view name, const HistogramSnapshot& histogram) {
+            out << name << " count="s << histogram.count << " sum="s << histogram.sum;
+            for (size_t bucket = 0; bucket < HistogramSnapshot::BUCKET_COUNT; ++bucket) {
+                if (histogram.buckets[bucket] != 0) {
+                    out << " <="s << HistogramSnapshot::GetBucketUpperBound(bucket) << ":"s << histogram.buckets[bucket];
+                }
+            }
+            out << "\n"s;
+        };
+        for (size_t stage = 0; stage < QUERY_STAGE_COUNT; ++stage) {
+            write_histogram("stage_ns."s + string(GetQueryStageName(static_cast<QueryStage>(stage))),
+                            stage_nanoseconds[stage]);
+        }
+        write_histogram("postings_visited"sv, postings_visited);
+        write_histogram("matched_documents"sv, matched_documents);
+    }
+    
+    void WriteJson(ostream& out) const {
+        const auto write_histogram = [&out](const HistogramSnapshot& histogram) {
+            out << "{\"count\":"s << histogram.count << ",\"sum\":"s << histogram.sum << ",\"buckets\":["s;
+            bool is_first = true;
+            for (size_t bucket = 0; bucket < HistogramSnapshot::BUCKET_COUNT; ++bucket) {
+                if (histogram.buckets[bucket] != 0) {
+                    out << (is_first ? "["s : ",["s) << HistogramSnapshot::GetBucketUpperBound(bucket) << ","s
+                        << histogram.buckets[bucket] << "]"s;
+                    is_first = false;
+                }
+            }
+            out << "]}"s;
+        };
+        out << "{\"stage_ns\":{"s;
+        for (size_t stage = 0; stage < QUERY_STAGE_COUNT; ++stage) {
+            out << (stage == 0 ? "\""s : ",\""s) << GetQueryStageName(static_cast<QueryStage>(stage)) << "\":"s;
+            write_histogram(stage_nanoseconds[stage]);
+        }
+        out << "},\"postings_visited\":"s;
+        write_histogram(postings_visited);
+        out << ",\"matched_documents\":"s;
+        write_histogram(matched_documents);
+        out << "}"s;
+    }
+};
+
+#ifdef SEARCH_SERVER_STATS
+// Histogram that concurrent queries update without locks
+class AtomicHistogram {
 public:
-    template <typename StringContainer>
-    explicit SearchServer(const StringContainer& stop_words)
-            : stop_words_(MakeUniqueNonEmptyStrings(stop_words))  // Extract non-empty stop words
-    {
-        if (!all_of(stop_words_.begin(), stop_words_.end(), IsValidWord)) {
-            throw invalid_argument("Some of stop words are invalid"s);
+    AtomicHistogram() = default;
+    
+    AtomicHistogram(const AtomicHistogram& other) {
+        Assign(other.GetSnapshot());
+    }
+    
+    void Add(uint64_t value) {
+        buckets_[HistogramSnapshot::GetBucket(value)].fetch_add(1, memory_order_relaxed);
+        count_.fetch_add(1, memory_order_relaxed);
+        sum_.fetch_add(value, memory_order_relaxed);
+    }
+    
+    HistogramSnapshot GetSnapshot() const {
+        HistogramSnapshot snapshot;
+        snapshot.count = count_.load(memory_order_relaxed);
+        snapshot.sum = sum_.load(memory_order_relaxed);
+        for (size_t bucket = 0; bucket < HistogramSnapshot::BUCKET_COUNT; ++bucket) {
+            snapshot.buckets[bucket] = buckets_[bucket].load(memory_order_relaxed);
         }
+        return snapshot;
     }
     
-    explicit SearchServer(const string& stop_words_text)
-            : SearchServer(SplitIntoWords(stop_words_text))  // Invoke delegating constructor from string container
-    {
+    void Assign(const HistogramSnapshot& snapshot) {
+        count_.store(snapshot.count, memory_order_relaxed);
+        sum_.store(snapshot.sum, memory_order_relaxed);
+        for (size_t bucket = 0; bucket < HistogramSnapshot::BUCKET_COUNT; ++bucket) {
+            buckets_[bucket].store(snapshot.buckets[bucket], memory_order_relaxed);
+        }
+    }
+
+private:
+    atomic<uint64_t> count_{0};
+    atomic<uint64_t> sum_{0};
+    array<atomic<uint64_t>, HistogramSnapshot::BUCKET_COUNT> buckets_{};
+};
+
+class QueryStats {
+public:
+    void AddStageTime(QueryStage stage, uint64_t nanoseconds) {
+        stage_nanoseconds_[static_cast<size_t>(stage)].Add(nanoseconds);
     }
     
-    void AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings) {
-        if ((document_id < 0) || (documents_.count(document_id) > 0)) {
-            throw invalid_argument("Invalid document_id"s);
+    void AddQuery(uint64_t postings_visited, uint64_t matched_documents) {
+        postings_visited_.Add(postings_visited);
+        matched_documents_.Add(matched_documents);
+    }
+    
+    QueryStatsSnapshot GetSnapshot() const {
+        QueryStatsSnapshot snapshot;
+        for (size_t stage = 0; stage < QUERY_STAGE_COUNT; ++stage) {
+            snapshot.stage_nanoseconds[stage] = stage_nanoseconds_[stage].GetSnapshot();
         }
-        const auto words = SplitIntoWordsNoStop(document);
-        
-        const double inv_word_count = 1.0 / words.size();
-        for (const string& word : words) {
-            word_to_document_freqs_[word][document_id] += inv_word_count;
+        snapshot.postings_visited = postings_visited_.GetSnapshot();
+        snapshot.matched_documents = matched_documents_.GetSnapshot();
+        return snapshot;
+    }
+    
+    void Reset() {
+        for (auto& histogram : stage_nanoseconds_) {
+            histogram.Assign({});
         }
-        documents_.emplace(document_id, DocumentData{ComputeAverageRating(ratings), status});
-        document_ids_.push_back(document_id);
+        postings_visited_.Assign({});
+        matched_documents_.Assign({});
+    }
+
+private:
+    array<AtomicHistogram, QUERY_STAGE_COUNT> stage_nanoseconds_;
+    AtomicHistogram postings_visited_;
+    AtomicHistogram matched_documents_;
+};
+
+// Adds the time from construction to destruction to the stage
+class QueryStageTimer {
+public:
+    QueryStageTimer(QueryStats& stats, QueryStage stage)
+            : stats_(stats)
+            , stage_(stage)
+            , start_(chrono::steady_clock::now()) {
     }
     
-    template <typename DocumentPredicate>
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentPredicate document_predicate) const {
-        const auto query = ParseQuery(raw_query);
-        
-        auto matched_documents = FindAllDocuments(query, document_predicate);
-        
-        sort(matched_documents.begin(), matched_documents.end(), [](const Document& lhs, const Document& rhs) {
-            if (abs(lhs.relevance - rhs.relevance) < 1e-6) {
-                return lhs.rating > rhs.rating;
-            } else {
-                return lhs.relevance > rhs.relevance;
-            }
-        });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+    ~QueryStageTimer() {
+        const auto duration = chrono::steady_clock::now() - start_;
+        stats_.AddStageTime(stage_, chrono::duration_cast<chrono::nanoseconds>(duration).count());
+    }
+
+private:
+    QueryStats& stats_;
+    QueryStage stage_;
+    chrono::steady_clock::time_point start_;
+};
+#else
+class QueryStats {
+public:
+    void AddQuery(uint64_t, uint64_t) {
+    }
+    
+    QueryStatsSnapshot GetSnapshot() const {
+        return {};
+    }
+    
+    void Reset() {
+    }
+};
+
+class QueryStageTimer {
+public:
+    QueryStageTimer(QueryStats&, QueryStage) {
+    }
+};
+#endif
+
+// Associative container split into buckets, each guarded by its own mutex,
+// so threads updating different keys rarely wait for each other
+template <typename Key, typename Value>
+class ConcurrentMap {
+public:
+    struct Access {
+        lock_guard<mutex> guard;
+        Value& ref_to_value;
+    };
+    
+    explicit ConcurrentMap(size_t bucket_count)
+            : buckets_(bucket_count) {
+        if (bucket_count == 0) {
+            throw invalid_argument("Bucket count must be positive"s);
         }
-        
-        return matched_documents;
     }
     
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentStatus status) const {
-        return FindTopDocuments(raw_query, [status](int document_id, DocumentStatus document_status, int rating) {
-            return document_status == status;
-        });
+    Access operator[](const Key& key) {
+        auto& bucket = GetBucket(key);
+        return {lock_guard(bucket.guard), bucket.values[key]};
     }
     
-    vector<Document> FindTopDocuments(const string& raw_query) const {
-        return FindTopDocuments(raw_query, DocumentStatus::ACTUAL);
+    void erase(const Key& key) {
+        auto& bucket = GetBucket(key);
+        lock_guard guard(bucket.guard);
+        bucket.values.erase(key);
     }
     
-    int GetDocumentCount() const {
-        return documents_.size();
+    map<Key, Value> BuildOrdinaryMap() {
+        map<Key, Value> result;
+        for (auto& bucket : buckets_) {
+            lock_guard guard(bucket.guard);
+            result.insert(bucket.values.begin(), bucket.values.end());
+        }
+        return result;
+    }
+
+private:
+    struct Bucket {
+        mutex guard;
+        map<Key, Value> values;
+    };
+    vector<Bucket> buckets_;
+    
+    Bucket& GetBucket(const Key& key) {
+        return buckets_[hash<Key>{}(key) % buckets_.size()];
     }
+};
+
+// Document id and the number of occurrences of a word in that document
+struct Posting {
+    int document_id = 0;
+    int occurrences = 0;
+};
+
+// Posting list sorted by document id and compressed in blocks of up to BLOCK_SIZE postings.
+// A block keeps its first and last document ids, so it can be skipped or decoded on its own;
+// inside it every posting is stored as a varint delta from the previous id followed by
+// a varint number of occurrences (the first id is in the block header).
+// Adding a posting in the middle re-encodes a single block and moves the bytes after it.
+// Erasing re-encodes the block in place: it never gets longer, and the bytes it frees stay
+// unused until the block is rewritten, so nothing else moves unless the block becomes empty.
+class CompressedPostings {
+public:
+    static constexpr size_t BLOCK_SIZE = 128;
+    // Blocks filled by insertions in the middle are split when they grow above this size
+    static constexpr size_t MAX_BLOCK_SIZE = 2 * BLOCK_SIZE;
     
-    int GetDocumentId(int index) const {
-        return document_ids_.at(index);
+    struct Block {
+        int32_t first_document_id;
+        int32_t last_document_id;
+        uint32_t offset;  // in bytes
+        uint32_t size;    // in postings
+    };
+    
+    using BlockBuffer = array<Posting, MAX_BLOCK_SIZE>;
+    
+    // Blocks and bytes are allocated from resource
+    explicit CompressedPostings(pmr::memory_resource* resource = pmr::get_default_resource())
+            : blocks_(resource)
+            , bytes_(resource) {
     }
     
-    tuple<vector<string>, DocumentStatus> MatchDocument(const string& raw_query, int document_id) const {
-        const auto query = ParseQuery(raw_query);
+    // Walks postings in document id order and can jump forward over whole blocks
+    class Cursor {
+    public:
+        explicit Cursor(const CompressedPostings& postings)
+                : postings_(&postings)
+                , buffer_(make_unique<BlockBuffer>()) {
+            LoadBlock(0);
+        }
         
-        vector<string> matched_words;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.push_back(word);
+        bool IsEnd() const {
+            return block_index_ == postings_->blocks_.size();
+        }
+        
+        const Posting& Get() const {
+            return (*buffer_)[position_];
+        }
+        
+        void Next() {
+            if (++position_ == block_size_) {
+                LoadBlock(block_index_ + 1);
             }
         }
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+        
+        // Moves to the first posting with document id not less than document_id
+        void SkipTo(int document_id) {
+            if (IsEnd() || Get().document_id >= document_id) {
+                return;
             }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.clear();
-                break;
+            const auto& blocks = postings_->blocks_;
+            if (blocks[block_index_].last_document_id < document_id) {
+                const auto it = lower_bound(blocks.begin() + block_index_ + 1, blocks.end(), document_id,
+                                            [](const Block& block, int document_id) {
+                                                return block.last_document_id < document_id;
+                                            });
+                LoadBlock(it - blocks.begin());
+                if (IsEnd()) {
+                    return;
+                }
+            }
+            while ((*buffer_)[position_].document_id < document_id) {
+                ++position_;
             }
         }
-        return {matched_words, documents_.at(document_id).status};
-    }
-
-private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
+    
+    private:
+        const CompressedPostings* postings_;
+        unique_ptr<BlockBuffer> buffer_;
+        size_t block_index_ = 0;
+        size_t block_size_ = 0;
+        size_t position_ = 0;
+        
+        void LoadBlock(size_t block_index) {
+            block_index_ = block_index;
+            position_ = 0;
+            block_size_ = IsEnd() ? 0 : postings_->DecodeBlock(block_index, *buffer_);
+        }
     };
-    const set<string> stop_words_;
-    map<string, map<int, double>> word_to_document_freqs_;
-    map<int, DocumentData> documents_;
-    vector<int> document_ids_;
     
-    bool IsStopWord(const string& word) const {
-        return stop_words_.count(word) > 0;
+    size_t size() const {
+        return size_;
     }
     
-    static bool IsValidWord(const string& word) {
-        // A valid word must not contain special characters
-        return none_of(word.begin(), word.end(), [](char c) {
-            return c >= '\0' && c < ' ';
-        });
+    bool empty() const {
+        return size_ == 0;
     }
     
-    vector<string> SplitIntoWordsNoStop(const string& text) const {
-        vector<string> words;
-        for (const string& word : SplitIntoWords(text)) {
-            if (!IsValidWord(word)) {
-                throw invalid_argument("Word "s + word + " is invalid"s);
-            }
-            if (!IsStopWord(word)) {
-                words.push_back(word);
+    const pmr::vector<Block>& GetBlocks() const {
+        return blocks_;
+    }
+    
+    const pmr::vector<uint8_t>& GetBytes() const {
+        return bytes_;
+    }
+    
+    void Add(Posting posting) {
+        ++size_;
+        if (blocks_.empty() || blocks_.back().last_document_id < posting.document_id) {
+            if (blocks_.empty() || blocks_.back().size >= BLOCK_SIZE) {
+                blocks_.push_back({posting.document_id, posting.document_id, static_cast<uint32_t>(bytes_.size()), 1});
+            } else {
+                Block& block = blocks_.back();
+                WriteVarint(bytes_, static_cast<uint32_t>(posting.document_id - block.last_document_id));
+                block.last_document_id = posting.document_id;
+                ++block.size;
             }
+            WriteVarint(bytes_, static_cast<uint32_t>(posting.occurrences));
+            return;
         }
-        return words;
+        
+        const size_t block_index = FindBlock(posting.document_id);
+        BlockBuffer buffer;
+        const size_t block_size = DecodeBlock(block_index, buffer);
+        vector<Posting> block_postings(buffer.begin(), buffer.begin() + block_size);
+        block_postings.insert(lower_bound(block_postings.begin(), block_postings.end(), posting.document_id,
+                                          [](const Posting& lhs, int document_id) {
+                                              return lhs.document_id < document_id;
+                                          }),
+                              posting);
+        ReplaceBlock(block_index, block_postings);
     }
     
-    static int ComputeAverageRating(const vector<int>& ratings) {
-        if (ratings.empty()) {
-            return 0;
+    // Returns false when there is no posting for document_id
+    bool Erase(int document_id) {
+        const size_t block_index = FindBlock(document_id);
+        if (block_index == blocks_.size() || blocks_[block_index].first_document_id > document_id) {
+            return false;
         }
-        int rating_sum = 0;
-        for (const int rating : ratings) {
-            rating_sum += rating;
+        BlockBuffer buffer;
+        const size_t block_size = DecodeBlock(block_index, buffer);
+        const auto block_end = buffer.begin() + block_size;
+        const auto it = lower_bound(buffer.begin(), block_end, document_id, [](const Posting& lhs, int document_id) {
+            return lhs.document_id < document_id;
+        });
+        if (it == block_end || it->document_id != document_id) {
+            return false;
         }
-        return rating_sum / static_cast<int>(ratings.size());
+        --size_;
+        
+        if (block_size == 1) {
+            blocks_.erase(blocks_.begin() + block_index);
+        } else {
+            copy(it + 1, block_end, it);
+            Block& block = blocks_[block_index];
+            block.first_document_id = buffer[0].document_id;
+            block.last_document_id = buffer[block_size - 2].document_id;
+            --block.size;
+            // Merging two deltas into one never takes more bytes than both of them,
+            // so the postings are written over the old ones
+            WritePostings(bytes_.data() + block.offset, buffer.data(), buffer.data() + block.size);
+        }
+        if (blocks_.empty()) {
+            bytes_.clear();
+        } else if (block_index + 1 >= blocks_.size()) {
+            TrimBytes();
+        }
+        return true;
     }
     
-    struct QueryWord {
-        string data;
-        bool is_minus;
-        bool is_stop;
-    };
+    bool Contains(int document_id) const {
+        return GetOccurrences(document_id) > 0;
+    }
     
-    QueryWord ParseQueryWord(const string& text) const {
-        if (text.empty()) {
-            throw invalid_argument("Query word is empty"s);
-        }
-        string word = text;
-        bool is_minus = false;
-        if (word[0] == '-') {
-            is_minus = true;
-            word = word.substr(1);
+    // Decodes at most one block, returns 0 when there is no posting for document_id
+    int GetOccurrences(int document_id) const {
+        const size_t block_index = FindBlock(document_id);
+        if (block_index == blocks_.size() || blocks_[block_index].first_document_id > document_id) {
+            return 0;
         }
-        if (word.empty() || word[0] == '-' || !IsValidWord(word)) {
-            throw invalid_argument("Query word "s + text + " is invalid");
+        const uint8_t* data = bytes_.data() + blocks_[block_index].offset;
+        const uint8_t* end = GetBlockEnd(block_index);
+        int current_id = blocks_[block_index].first_document_id;
+        int occurrences = static_cast<int>(ReadVarint(data, end));
+        while (current_id < document_id && data != end) {
+            current_id += static_cast<int>(ReadVarint(data, end));
+            occurrences = static_cast<int>(ReadVarint(data, end));
         }
-        
-        return {word, is_minus, IsStopWord(word)};
+        return current_id == document_id ? occurrences : 0;
     }
     
-    struct Query {
-        set<string> plus_words;
-        set<string> minus_words;
-    };
+    // Blocks are decoded independently, so with a parallel policy they are handled concurrently
+    template <typename ExecutionPolicy, typename PostingHandler>
+    void ForEach(ExecutionPolicy&& policy, PostingHandler handle_posting) const {
+        for_each(policy, blocks_.begin(), blocks_.end(),
+                 [this, &handle_posting](const Block& block) {
+                     BlockBuffer buffer;
+                     const size_t block_size = DecodeBlock(&block - blocks_.data(), buffer);
+                     for (size_t i = 0; i < block_size; ++i) {
+                         handle_posting(buffer[i]);
+                     }
+                 });
+    }
     
-    Query ParseQuery(const string& text) const {
-        Query result;
-        for (const string& word : SplitIntoWords(text)) {
-            const auto query_word = ParseQueryWord(word);
-            if (!query_word.is_stop) {
-                if (query_word.is_minus) {
-                    result.minus_words.insert(query_word.data);
-                } else {
-                    result.plus_words.insert(query_word.data);
-                }
+    template <typename PostingHandler>
+    void ForEach(PostingHandler handle_posting) const {
+        ForEach(execution::seq, handle_posting);
+    }
+    
+    size_t DecodeBlock(size_t block_index, BlockBuffer& buffer) const {
+        const Block& block = blocks_[block_index];
+        const uint8_t* data = bytes_.data() + block.offset;
+        const uint8_t* end = GetBlockEnd(block_index);
+        int document_id = block.first_document_id;
+        size_t count = 0;
+        while (data != end && count < block.size) {
+            if (count > 0) {
+                document_id += static_cast<int>(ReadVarint(data, end));
             }
+            buffer[count++] = {document_id, static_cast<int>(ReadVarint(data, end))};
         }
-        return result;
+        return count;
     }
     
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+    // Takes blocks and bytes read from an index file, returns false if they are inconsistent
+    bool Assign(const Block* blocks, size_t block_count, const uint8_t* bytes, size_t byte_count) {
+        return Assign(blocks, block_count, bytes, byte_count, [](const Posting&) {
+            return true;
+        });
     }
     
-    template <typename DocumentPredicate>
-    vector<Document> FindAllDocuments(const Query& query, DocumentPredicate document_predicate) const {
-        map<int, double> document_to_relevance;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+    // Also returns false if is_valid_posting rejects one of the postings, which are decoded only once
+    template <typename PostingPredicate>
+    bool Assign(const Block* blocks, size_t block_count, const uint8_t* bytes, size_t byte_count,
+                PostingPredicate is_valid_posting) {
+        blocks_.assign(blocks, blocks + block_count);
+        bytes_.assign(bytes, bytes + byte_count);
+        size_ = 0;
+        BlockBuffer buffer;
+        int previous_id = -1;
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            const Block& block = blocks_[i];
+            if (block.offset >= byte_count || (i > 0 && block.offset <= blocks_[i - 1].offset)
+                || block.size == 0 || block.size > MAX_BLOCK_SIZE) {
+                return false;
             }
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
-                const auto& document_data = documents_.at(document_id);
-                if (document_predicate(document_id, document_data.status, document_data.rating)) {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
+            const size_t block_size = DecodeBlock(i, buffer);
+            if (block_size != block.size || buffer[0].document_id != block.first_document_id
+                || buffer[block_size - 1].document_id != block.last_document_id || block.first_document_id <= previous_id) {
+                return false;
+            }
+            for (size_t j = 0; j < block_size; ++j) {
+                if ((j > 0 && buffer[j].document_id <= buffer[j - 1].document_id) || !is_valid_posting(buffer[j])) {
+                    return false;
                 }
             }
+            previous_id = block.last_document_id;
+            size_ += block_size;
         }
-        
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
-            }
+        return !blocks_.empty() || byte_count == 0;
+    }
+
+private:
+    pmr::vector<Block> blocks_;
+    pmr::vector<uint8_t> bytes_;
+    size_t size_ = 0;
+    
+    static constexpr size_t MAX_VARINT_SIZE = 5;
+    
+    static void WriteVarint(pmr::vector<uint8_t>& bytes, uint32_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
         }
-        
-        vector<Document> matched_documents;
-        for (const auto [document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back({document_id, relevance, documents_.at(document_id).rating});
+        bytes.push_back(static_cast<uint8_t>(value));
+    }
+    
+    // Returns the end of the written value
+    static uint8_t* WriteVarint(uint8_t* data, uint32_t value) {
+        while (value >= 0x80) {
+            *data++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *data++ = static_cast<uint8_t>(value);
+        return data;
+    }
+    
+    // Never reads past end, a truncated value is returned as is
+    static uint32_t ReadVarint(const uint8_t*& data, const uint8_t* end) {
+        uint32_t value = 0;
+        for (int shift = 0; data != end && shift < 35; shift += 7) {
+            const uint8_t byte = *data++;
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+        }
+        return value;
+    }
+    
+    // Returns the end of the written postings, which take at most 2 * MAX_VARINT_SIZE bytes each
+    static uint8_t* WritePostings(uint8_t* data, const Posting* begin, const Posting* end) {
+        for (const Posting* posting = begin; posting != end; ++posting) {
+            if (posting != begin) {
+                data = WriteVarint(data, static_cast<uint32_t>(posting->document_id - (posting - 1)->document_id));
+            }
+            data = WriteVarint(data, static_cast<uint32_t>(posting->occurrences));
+        }
+        return data;
+    }
+    
+    // Includes the unused bytes left by erasing
+    const uint8_t* GetBlockEnd(size_t block_index) const {
+        return bytes_.data() + (block_index + 1 < blocks_.size() ? blocks_[block_index + 1].offset : bytes_.size());
+    }
+    
+    // The block that contains document_id or would contain it, blocks_.size() after the last block
+    size_t FindBlock(int document_id) const {
+        return lower_bound(blocks_.begin(), blocks_.end(), document_id,
+                           [](const Block& block, int document_id) {
+                               return block.last_document_id < document_id;
+                           }) - blocks_.begin();
+    }
+    
+    // Drops the unused bytes after the last block, so appending continues right after its last posting
+    void TrimBytes() {
+        const Block& block = blocks_.back();
+        const uint8_t* data = bytes_.data() + block.offset;
+        const uint8_t* end = bytes_.data() + bytes_.size();
+        for (uint32_t i = 0; i < block.size; ++i) {
+            if (i > 0) {
+                ReadVarint(data, end);
+            }
+            ReadVarint(data, end);
+        }
+        bytes_.resize(data - bytes_.data());
+    }
+    
+    // Re-encodes the block from its postings
+    void ReplaceBlock(size_t block_index, const vector<Posting>& postings) {
+        vector<Block> new_blocks;
+        vector<uint8_t> new_bytes(2 * MAX_VARINT_SIZE * postings.size());
+        uint8_t* new_bytes_end = new_bytes.data();
+        const uint32_t offset = blocks_[block_index].offset;
+        // A single insertion makes a block at most one posting too large, so halves always fit
+        const size_t part_size = postings.size() > MAX_BLOCK_SIZE ? (postings.size() + 1) / 2 : postings.size();
+        for (size_t begin = 0; begin < postings.size(); begin += part_size) {
+            const size_t end = min(begin + part_size, postings.size());
+            new_blocks.push_back({postings[begin].document_id, postings[end - 1].document_id,
+                                  static_cast<uint32_t>(offset + (new_bytes_end - new_bytes.data())),
+                                  static_cast<uint32_t>(end - begin)});
+            new_bytes_end = WritePostings(new_bytes_end, postings.data() + begin, postings.data() + end);
+        }
+        new_bytes.resize(new_bytes_end - new_bytes.data());
+        
+        const auto old_begin = bytes_.begin() + offset;
+        const auto old_end = bytes_.begin() + (GetBlockEnd(block_index) - bytes_.data());
+        const int64_t shift = static_cast<int64_t>(new_bytes.size()) - (old_end - old_begin);
+        bytes_.insert(bytes_.erase(old_begin, old_end), new_bytes.begin(), new_bytes.end());
+        for (size_t i = block_index + 1; i < blocks_.size(); ++i) {
+            blocks_[i].offset = static_cast<uint32_t>(blocks_[i].offset + shift);
+        }
+        blocks_.erase(blocks_.begin() + block_index);
+        blocks_.insert(blocks_.begin() + block_index, new_blocks.begin(), new_blocks.end());
+    }
+};
+
+// Set of document ids in the roaring layout: ids are grouped by their upper 16 bits and every
+// group keeps the lower halves in a sorted array while it is sparse and in a 65536-bit bitmap
+// once it gets dense. Adding ids in ascending order only appends.
+class DocumentIdBitmap {
+public:
+    void Add(int document_id) {
+        const auto value = static_cast<uint32_t>(document_id);
+        Container& container = GetContainer(static_cast<uint16_t>(value >> 16));
+        const auto low = static_cast<uint16_t>(value);
+        if (!container.bits.empty()) {
+            container.bits[low / 64] |= uint64_t{1} << (low % 64);
+            return;
+        }
+        
+        auto& values = container.values;
+        if (values.empty() || values.back() < low) {
+            values.push_back(low);
+        } else {
+            const auto it = lower_bound(values.begin(), values.end(), low);
+            if (*it == low) {
+                return;
+            }
+            values.insert(it, low);
+        }
+        if (values.size() > MAX_ARRAY_SIZE) {
+            container.bits.assign(BITMAP_WORD_COUNT, 0);
+            for (const uint16_t value : values) {
+                container.bits[value / 64] |= uint64_t{1} << (value % 64);
+            }
+            values = {};
+        }
+    }
+    
+    bool Contains(int document_id) const {
+        const auto value = static_cast<uint32_t>(document_id);
+        const auto key = static_cast<uint16_t>(value >> 16);
+        const auto it = lower_bound(containers_.begin(), containers_.end(), key,
+                                    [](const Container& container, uint16_t key) {
+                                        return container.key < key;
+                                    });
+        if (it == containers_.end() || it->key != key) {
+            return false;
+        }
+        const auto low = static_cast<uint16_t>(value);
+        if (!it->bits.empty()) {
+            return (it->bits[low / 64] >> (low % 64)) & 1;
+        }
+        return binary_search(it->values.begin(), it->values.end(), low);
+    }
+    
+    bool empty() const {
+        return containers_.empty();
+    }
+
+private:
+    // Above this size an array takes more memory than the bitmap
+    static constexpr size_t MAX_ARRAY_SIZE = 4096;
+    static constexpr size_t BITMAP_WORD_COUNT = 65536 / 64;
+    
+    struct Container {
+        uint16_t key;
+        vector<uint16_t> values;  // sorted, used while bits is empty
+        vector<uint64_t> bits;
+    };
+    
+    vector<Container> containers_;  // sorted by key
+    
+    Container& GetContainer(uint16_t key) {
+        if (containers_.empty() || containers_.back().key < key) {
+            return containers_.emplace_back(Container{key, {}, {}});
+        }
+        auto it = lower_bound(containers_.begin(), containers_.end(), key,
+                              [](const Container& container, uint16_t key) {
+                                  return container.key < key;
+                              });
+        if (it == containers_.end() || it->key != key) {
+            it = containers_.insert(it, Container{key, {}, {}});
+        }
+        return *it;
+    }
+};
+
+// Fixed set of words in an open-addressed table that is at most a quarter full, so most lookups
+// take a single probe. Slots keep the full hash of their word and strings are compared only
+// when the hashes are equal.
+class StopWordSet {
+public:
+    explicit StopWordSet(const set<string, less<>>& words)
+            : words_(words.begin(), words.end()) {
+        size_t capacity = 1;
+        while (capacity < 4 * words_.size()) {
+            capacity *= 2;
+        }
+        mask_ = capacity - 1;
+        slots_.assign(capacity, Slot{0, EMPTY_SLOT});
+        for (uint32_t word_index = 0; word_index < words_.size(); ++word_index) {
+            const size_t hash = std::hash<string_view>{}(words_[word_index]);
+            size_t position = hash & mask_;
+            while (slots_[position].word_index != EMPTY_SLOT) {
+                position = (position + 1) & mask_;
+            }
+            slots_[position] = {hash, word_index};
+        }
+    }
+    
+    bool Contains(string_view word) const {
+        if (words_.empty()) {
+            return false;
+        }
+        const size_t hash = std::hash<string_view>{}(word);
+        for (size_t position = hash & mask_; ; position = (position + 1) & mask_) {
+            const Slot& slot = slots_[position];
+            if (slot.word_index == EMPTY_SLOT) {
+                return false;
+            }
+            if (slot.hash == hash && words_[slot.word_index] == word) {
+                return true;
+            }
+        }
+    }
+    
+    size_t size() const {
+        return words_.size();
+    }
+    
+    // Words in ascending order
+    vector<string>::const_iterator begin() const {
+        return words_.begin();
+    }
+    
+    vector<string>::const_iterator end() const {
+        return words_.end();
+    }
+
+private:
+    static constexpr uint32_t EMPTY_SLOT = numeric_limits<uint32_t>::max();
+    
+    struct Slot {
+        size_t hash;
+        uint32_t word_index;
+    };
+    
+    vector<string> words_;
+    vector<Slot> slots_;
+    size_t mask_ = 0;
+};
+
+// Read-only memory mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open "s + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw runtime_error("Failed to stat "s + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Failed to map "s + path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+    
+    // Checks that count objects of type T starting at offset lie inside the file and are aligned
+    template <typename T>
+    const T* GetArray(uint64_t offset, uint64_t count) const {
+        if (offset > size_ || count > (size_ - offset) / sizeof(T) || offset % alignof(T) != 0) {
+            throw runtime_error("Corrupted index file"s);
+        }
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
+    
+    string_view GetString(uint64_t offset, uint64_t length) const {
+        return {GetArray<char>(offset, length), static_cast<size_t>(length)};
+    }
+    
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Layout of an index file written by SearchServer::SaveIndex: header, stop words, terms,
+// documents, posting blocks, compressed posting bytes and the blob with the characters of all words.
+// Every section before the posting bytes is an array of fixed-size records aligned to 8 bytes.
+const char INDEX_FILE_MAGIC[8] = {'S', 'S', 'I', 'N', 'D', 'E', 'X', '3'};
+
+struct IndexFileHeader {
+    char magic[8];
+    uint64_t stop_word_count;
+    uint64_t term_count;
+    uint64_t document_count;
+    uint64_t block_count;
+    uint64_t posting_byte_count;
+};
+
+struct IndexFileString {
+    uint64_t offset;  // relative to the beginning of the blob
+    uint64_t length;
+};
+
+struct IndexFileTerm {
+    IndexFileString word;
+    uint64_t first_block;
+    uint64_t block_count;
+    uint64_t first_byte;
+    uint64_t byte_count;
+    double max_term_freq;
+};
+
+// Documents are stored by ordinal, a free ordinal has the id -1
+struct IndexFileDocument {
+    int32_t id;
+    int32_t rating;
+    int32_t status;
+    int32_t word_count;
+};
+
+struct IndexFileLayout {
+    explicit IndexFileLayout(const IndexFileHeader& header)
+            : stop_words_offset(sizeof(IndexFileHeader))
+            , terms_offset(stop_words_offset + header.stop_word_count * sizeof(IndexFileString))
+            , documents_offset(terms_offset + header.term_count * sizeof(IndexFileTerm))
+            , blocks_offset(documents_offset + header.document_count * sizeof(IndexFileDocument))
+            , posting_bytes_offset(blocks_offset + header.block_count * sizeof(CompressedPostings::Block))
+            , blob_offset(posting_bytes_offset + header.posting_byte_count) {
+    }
+    
+    uint64_t stop_words_offset;
+    uint64_t terms_offset;
+    uint64_t documents_offset;
+    uint64_t blocks_offset;
+    uint64_t posting_bytes_offset;
+    uint64_t blob_offset;
+};
+
+// EXHAUSTIVE scores every posting of every plus word. WAND visits documents in posting order
+// and skips those whose best possible relevance cannot get into the current top documents.
+// Both return the same documents.
+enum class ScoringMode {
+    EXHAUSTIVE,
+    WAND,
+};
+
+enum class DocumentStatus {
+    ACTUAL,
+    IRRELEVANT,
+    BANNED,
+    REMOVED,
+};
+
+struct RawDocument {
+    int id = 0;
+    string text;
+    DocumentStatus status = DocumentStatus::ACTUAL;
+    vector<int> ratings;
+};
+
+// Predicates that FindTopDocuments recognizes by type. They work as ordinary predicates too,
+// but the server evaluates them on its own columns and caches their results by value.
+struct StatusEquals {
+    DocumentStatus status = DocumentStatus::ACTUAL;
+    
+    bool operator()(int, DocumentStatus document_status, int) const {
+        return document_status == status;
+    }
+};
+
+// Both bounds are inclusive
+struct RatingRange {
+    int min_rating = numeric_limits<int>::min();
+    int max_rating = numeric_limits<int>::max();
+    
+    bool operator()(int, DocumentStatus, int rating) const {
+        return min_rating <= rating && rating <= max_rating;
+    }
+};
+
+// When the set is small, documents are looked up in the posting lists one by one
+// instead of scanning the lists
+class DocumentIdSet {
+public:
+    explicit DocumentIdSet(vector<int> document_ids)
+            : document_ids_(move(document_ids)) {
+        sort(document_ids_.begin(), document_ids_.end());
+        document_ids_.erase(unique(document_ids_.begin(), document_ids_.end()), document_ids_.end());
+    }
+    
+    DocumentIdSet(initializer_list<int> document_ids)
+            : DocumentIdSet(vector<int>(document_ids)) {
+    }
+    
+    bool operator()(int document_id, DocumentStatus, int) const {
+        return binary_search(document_ids_.begin(), document_ids_.end(), document_id);
+    }
+    
+    const vector<int>& GetDocumentIds() const {
+        return document_ids_;
+    }
+
+private:
+    vector<int> document_ids_;  // sorted and unique
+};
+
+class SearchServer {
+public:
+    template <typename StringContainer>
+    explicit SearchServer(const StringContainer& stop_words)
+            : stop_words_(MakeUniqueNonEmptyStrings(stop_words))  // Extract non-empty stop words
+    {
+        if (!all_of(stop_words_.begin(), stop_words_.end(), IsValidWord)) {
+            throw invalid_argument("Some of stop words are invalid"s);
+        }
+    }
+    
+    explicit SearchServer(const string& stop_words_text)
+            : SearchServer(string_view(stop_words_text))
+    {
+    }
+    
+    explicit SearchServer(string_view stop_words_text)
+            : SearchServer(SplitIntoWords(stop_words_text))  // Invoke delegating constructor from string container
+    {
+    }
+    
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        PROFILE_OPERATION("AddDocument"sv);
+        if (!IsNewDocumentId(document_id)) {
+            throw invalid_argument("Invalid document_id"s);
+        }
+        array<byte, INGEST_BUFFER_SIZE> ingest_buffer;
+        pmr::monotonic_buffer_resource ingest_resource(ingest_buffer.data(), ingest_buffer.size());
+        const auto document_words = CountWords(document, &ingest_resource);
+        
+        for (const auto& [posting_list, posting] : RegisterDocument(document_id, document_words, status, ratings)) {
+            posting_list->postings.Add(posting);
+        }
+    }
+    
+    // Documents are tokenized and filtered in parallel, then registered one by one in input
+    // order and their postings are merged into the index list by list. Errors are the same
+    // as AddDocument would throw; the error of a successfully added document is empty.
+    // Word counts of the whole batch come from one pool that is released at once.
+    template <typename ExecutionPolicy>
+    vector<exception_ptr> AddDocuments(ExecutionPolicy&& policy, const vector<RawDocument>& documents) {
+        pmr::synchronized_pool_resource ingest_resource;
+        struct TokenizedDocument {
+            // Emplaced rather than assigned, so the counts keep their memory resource
+            optional<DocumentWords> words;
+            exception_ptr error;
+        };
+        vector<TokenizedDocument> tokenized_documents(documents.size());
+        transform(policy, documents.begin(), documents.end(), tokenized_documents.begin(),
+                  [this, &ingest_resource](const RawDocument& document) {
+                      TokenizedDocument tokenized_document;
+                      try {
+                          tokenized_document.words.emplace(CountWords(document.text, &ingest_resource));
+                      } catch (...) {
+                          tokenized_document.error = current_exception();
+                      }
+                      return tokenized_document;
+                  });
+        
+        vector<exception_ptr> errors(documents.size());
+        vector<pair<PostingList*, Posting>> new_postings;
+        for (size_t i = 0; i < documents.size(); ++i) {
+            const RawDocument& document = documents[i];
+            const TokenizedDocument& tokenized_document = tokenized_documents[i];
+            if (!IsNewDocumentId(document.id)) {
+                errors[i] = make_exception_ptr(invalid_argument("Invalid document_id"s));
+                continue;
+            }
+            if (tokenized_document.error) {
+                errors[i] = tokenized_document.error;
+                continue;
+            }
+            const auto document_postings = RegisterDocument(document.id, *tokenized_document.words,
+                                                            document.status, document.ratings);
+            new_postings.insert(new_postings.end(), document_postings.begin(), document_postings.end());
+        }
+        
+        // Every posting list is a separate group, so groups can be merged concurrently
+        sort(policy, new_postings.begin(), new_postings.end(), [](const auto& lhs, const auto& rhs) {
+            if (lhs.first != rhs.first) {
+                return less<PostingList*>{}(lhs.first, rhs.first);
+            }
+            return lhs.second.document_id < rhs.second.document_id;
+        });
+        vector<size_t> group_begins;
+        for (size_t i = 0; i < new_postings.size(); ++i) {
+            if (i == 0 || new_postings[i].first != new_postings[i - 1].first) {
+                group_begins.push_back(i);
+            }
+        }
+        for_each(policy, group_begins.begin(), group_begins.end(),
+                 [&new_postings](size_t group_begin) {
+                     PostingList& posting_list = *new_postings[group_begin].first;
+                     for (size_t i = group_begin; i < new_postings.size() && new_postings[i].first == &posting_list; ++i) {
+                         posting_list.postings.Add(new_postings[i].second);
+                     }
+                 });
+        return errors;
+    }
+    
+    vector<exception_ptr> AddDocuments(const vector<RawDocument>& documents) {
+        return AddDocuments(execution::par, documents);
+    }
+    
+    // Costs O(W log N) for a document of W words: only its own posting lists are touched, and
+    // in each of them a single block is re-encoded in place. Block headers move only when
+    // a block becomes empty, and ordinals are compacted in bulk, amortized over the removals.
+    template <typename ExecutionPolicy>
+    void RemoveDocument(ExecutionPolicy&& policy, int document_id) {
+        LoadDocumentWords();
+        const auto document_it = document_to_word_freqs_.find(document_id);
+        if (document_it == document_to_word_freqs_.end()) {
+            return;
+        }
+        const auto& word_freqs = document_it->second;
+        const int ordinal = documents_.GetOrdinal(document_id);
+        
+        vector<PostingList*> posting_lists(word_freqs.size());
+        transform(policy, word_freqs.begin(), word_freqs.end(), posting_lists.begin(),
+                  [this](const auto& word_freq) {
+                      return &word_to_document_freqs_.find(word_freq.first)->second;
+                  });
+        for_each(policy, posting_lists.begin(), posting_lists.end(),
+                 [ordinal](PostingList* posting_list) {
+                     // max_term_freq stays as it was, it is still an upper bound
+                     posting_list->postings.Erase(ordinal);
+                 });
+        
+        for (const auto& [word, _] : word_freqs) {
+            const auto it = word_to_document_freqs_.find(word);
+            if (it->second.postings.empty()) {
+                word_to_document_freqs_.erase(it);
+                // Words of an opened index live in the mapped file, not in words_
+                const auto stored_word = words_.find(word);
+                if (stored_word != words_.end()) {
+                    words_.erase(stored_word);
+                }
+            }
+        }
+        document_to_word_freqs_.erase(document_it);
+        documents_.Remove(document_id);
+        document_ids_.erase(document_id);
+        // Once most ordinals are free, renumbering costs no more than the removals so far
+        if (documents_.GetFreeOrdinalCount() > documents_.size()) {
+            CompactOrdinals(policy);
+        }
+        ++index_epoch_;
+        query_cache_.Clear();
+    }
+    
+    void RemoveDocument(int document_id) {
+        RemoveDocument(execution::seq, document_id);
+    }
+    
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate) const {
+        PROFILE_OPERATION("FindTopDocuments"sv);
+        const auto query = ParseQueryTimed(raw_query);
+        
+        if constexpr (is_same_v<DocumentPredicate, StatusEquals>) {
+            return FindCachedTopDocuments(policy, query, "status "s + to_string(static_cast<int>(document_predicate.status)),
+                                          document_predicate);
+        } else if constexpr (is_same_v<DocumentPredicate, RatingRange>) {
+            return FindCachedTopDocuments(policy, query, "rating "s + to_string(document_predicate.min_rating) + " "s
+                                                         + to_string(document_predicate.max_rating), document_predicate);
+        } else if constexpr (is_empty_v<DocumentPredicate>) {
+            // A predicate without captures is fully identified by its type
+            return FindCachedTopDocuments(policy, query, "type "s + typeid(DocumentPredicate).name(), document_predicate);
+        } else {
+            return FindAllDocuments(policy, query, document_predicate);
+        }
+    }
+    
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query, DocumentStatus status) const {
+        return FindTopDocuments(policy, raw_query, StatusEquals{status});
+    }
+    
+    template <typename ExecutionPolicy>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query) const {
+        return FindTopDocuments(policy, raw_query, DocumentStatus::ACTUAL);
+    }
+    
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate) const {
+        return FindTopDocuments(execution::seq, raw_query, document_predicate);
+    }
+    
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status) const {
+        return FindTopDocuments(execution::seq, raw_query, status);
+    }
+    
+    vector<Document> FindTopDocuments(string_view raw_query) const {
+        return FindTopDocuments(execution::seq, raw_query);
+    }
+    
+    void SetMaxResultDocumentCount(int max_result_document_count) {
+        if (max_result_document_count < 0) {
+            throw invalid_argument("Invalid max_result_document_count"s);
+        }
+        max_result_document_count_ = max_result_document_count;
+        query_cache_.Clear();
+    }
+    
+    // Affects sequential queries only
+    void SetScoringMode(ScoringMode scoring_mode) {
+        scoring_mode_ = scoring_mode;
+    }
+    
+    ScoringMode GetScoringMode() const {
+        return scoring_mode_;
+    }
+    
+    // Zero capacity turns the cache off
+    void SetQueryCacheCapacity(size_t capacity) {
+        query_cache_.SetCapacity(capacity);
+    }
+    
+    QueryCacheStats GetQueryCacheStats() const {
+        return query_cache_.GetStats();
+    }
+    
+    // Stays empty unless the server is built with SEARCH_SERVER_STATS. The parse stage counts
+    // every parsed query, including MatchDocument calls and queries answered from the query cache;
+    // the other histograms count only the queries that were scored (minus_words only those
+    // that scan posting lists rather than look up a small DocumentIdSet).
+    QueryStatsSnapshot GetQueryStats() const {
+        return query_stats_.GetSnapshot();
+    }
+    
+    void ResetQueryStats() {
+        query_stats_.Reset();
+    }
+    
+    int GetMaxResultDocumentCount() const {
+        return max_result_document_count_;
+    }
+    
+    int GetDocumentCount() const {
+        return documents_.size();
+    }
+    
+    // Walks the id set from its beginning, so looping over all documents this way is quadratic
+    [[deprecated("Iterate over the server with begin() and end() instead")]]
+    int GetDocumentId(int index) const {
+        if (index < 0 || index >= GetDocumentCount()) {
+            throw out_of_range("Invalid document index"s);
+        }
+        return *next(document_ids_.begin(), index);
+    }
+    
+    pmr::set<int>::const_iterator begin() const {
+        return document_ids_.begin();
+    }
+    
+    pmr::set<int>::const_iterator end() const {
+        return document_ids_.end();
+    }
+    
+    // Postings are written as they lie in memory, so the file is only readable on the same platform.
+    // The index is written next to path and renamed over it when complete, so path always holds
+    // a whole index, and an index opened from path stays readable while it is saved again.
+    void SaveIndex(const string& path) const {
+        const string temporary_path = path + ".tmp"s;
+        ofstream out(temporary_path, ios::binary | ios::trunc);
+        if (!out) {
+            throw runtime_error("Failed to create "s + temporary_path);
+        }
+        
+        IndexFileHeader header;
+        copy(std::begin(INDEX_FILE_MAGIC), std::end(INDEX_FILE_MAGIC), header.magic);
+        header.stop_word_count = stop_words_.size();
+        header.term_count = word_to_document_freqs_.size();
+        header.document_count = documents_.GetOrdinalCount();
+        header.block_count = 0;
+        header.posting_byte_count = 0;
+        for (const auto& [_, posting_list] : word_to_document_freqs_) {
+            header.block_count += posting_list.postings.GetBlocks().size();
+            header.posting_byte_count += posting_list.postings.GetBytes().size();
+        }
+        const auto write = [&out](const auto* data, size_t count) {
+            out.write(reinterpret_cast<const char*>(data), count * sizeof(*data));
+        };
+        write(&header, 1);
+        
+        uint64_t blob_size = 0;
+        const auto add_to_blob = [&blob_size](string_view word) {
+            const IndexFileString stored_word{blob_size, word.size()};
+            blob_size += word.size();
+            return stored_word;
+        };
+        for (const string& word : stop_words_) {
+            const auto stored_word = add_to_blob(word);
+            write(&stored_word, 1);
+        }
+        uint64_t first_block = 0;
+        uint64_t first_byte = 0;
+        for (const auto& [word, posting_list] : word_to_document_freqs_) {
+            const auto& blocks = posting_list.postings.GetBlocks();
+            const auto& bytes = posting_list.postings.GetBytes();
+            const IndexFileTerm term{add_to_blob(word), first_block, blocks.size(), first_byte, bytes.size(),
+                                     posting_list.max_term_freq};
+            write(&term, 1);
+            first_block += blocks.size();
+            first_byte += bytes.size();
+        }
+        for (int ordinal = 0; ordinal < documents_.GetOrdinalCount(); ++ordinal) {
+            const IndexFileDocument document{documents_.GetId(ordinal), documents_.GetRating(ordinal),
+                                             static_cast<int32_t>(documents_.GetStatus(ordinal)),
+                                             documents_.GetWordCount(ordinal)};
+            write(&document, 1);
+        }
+        for (const auto& [_, posting_list] : word_to_document_freqs_) {
+            write(posting_list.postings.GetBlocks().data(), posting_list.postings.GetBlocks().size());
+        }
+        for (const auto& [_, posting_list] : word_to_document_freqs_) {
+            write(posting_list.postings.GetBytes().data(), posting_list.postings.GetBytes().size());
+        }
+        for (const string& word : stop_words_) {
+            write(word.data(), word.size());
+        }
+        for (const auto& [word, _] : word_to_document_freqs_) {
+            write(word.data(), word.size());
+        }
+        
+        out.close();
+        if (!out || rename(temporary_path.c_str(), path.c_str()) != 0) {
+            remove(temporary_path.c_str());
+            throw runtime_error("Failed to write "s + path);
+        }
+    }
+    
+    // Words of the loaded index point straight into the mapped file, compressed posting lists
+    // are copied in bulk. Nothing is tokenized again, and the word frequencies of the documents
+    // are only collected by the first call that needs them.
+    static SearchServer OpenIndex(const string& path) {
+        auto file = make_shared<const MappedFile>(path);
+        const IndexFileHeader& header = *file->GetArray<IndexFileHeader>(0, 1);
+        if (!equal(std::begin(INDEX_FILE_MAGIC), std::end(INDEX_FILE_MAGIC), header.magic)) {
+            throw runtime_error(path + " is not an index file"s);
+        }
+        // No count can exceed the file size, which also keeps the section offsets from overflowing
+        const uint64_t file_size = file->size();
+        if (header.stop_word_count > file_size || header.term_count > file_size || header.document_count > file_size
+            || header.block_count > file_size || header.posting_byte_count > file_size) {
+            throw runtime_error("Corrupted index file"s);
+        }
+        const IndexFileLayout layout(header);
+        const uint64_t blob_offset = layout.blob_offset;
+        const auto get_word = [&file, blob_offset](const IndexFileString& word) {
+            if (word.offset > numeric_limits<uint64_t>::max() - blob_offset) {
+                throw runtime_error("Corrupted index file"s);
+            }
+            return file->GetString(blob_offset + word.offset, word.length);
+        };
+        
+        const auto* stored_stop_words = file->GetArray<IndexFileString>(layout.stop_words_offset, header.stop_word_count);
+        vector<string_view> stop_words;
+        for (uint64_t i = 0; i < header.stop_word_count; ++i) {
+            stop_words.push_back(get_word(stored_stop_words[i]));
+        }
+        if (!all_of(stop_words.begin(), stop_words.end(), IsValidWord)) {
+            throw runtime_error("Corrupted index file"s);
+        }
+        SearchServer search_server(stop_words);
+        search_server.mapped_index_ = file;
+        
+        if (header.document_count > static_cast<uint64_t>(numeric_limits<int>::max())) {
+            throw runtime_error("Corrupted index file"s);
+        }
+        const auto* documents = file->GetArray<IndexFileDocument>(layout.documents_offset, header.document_count);
+        for (uint64_t i = 0; i < header.document_count; ++i) {
+            const auto& document = documents[i];
+            if (document.id == -1) {
+                search_server.documents_.AddFreeOrdinal();
+                continue;
+            }
+            if (!search_server.IsNewDocumentId(document.id) || document.status < static_cast<int32_t>(DocumentStatus::ACTUAL)
+                || document.status > static_cast<int32_t>(DocumentStatus::REMOVED) || document.word_count < 0) {
+                throw runtime_error("Corrupted index file"s);
+            }
+            search_server.documents_.Add(document.id, document.rating, static_cast<DocumentStatus>(document.status),
+                                            document.word_count);
+            search_server.document_ids_.insert(document.id);
+        }
+        
+        const auto* terms = file->GetArray<IndexFileTerm>(layout.terms_offset, header.term_count);
+        const auto* blocks = file->GetArray<CompressedPostings::Block>(layout.blocks_offset, header.block_count);
+        const auto* posting_bytes = file->GetArray<uint8_t>(layout.posting_bytes_offset, header.posting_byte_count);
+        search_server.word_to_document_freqs_.reserve(header.term_count);
+        // A document holds each of its words at least once and no more often than it has words,
+        // so a document with postings never has a zero word count
+        const auto& document_table = search_server.documents_;
+        const auto is_valid_posting = [&document_table](const Posting& posting) {
+            const int ordinal = posting.document_id;
+            return ordinal >= 0 && ordinal < document_table.GetOrdinalCount() && document_table.GetId(ordinal) != -1
+                   && posting.occurrences > 0 && posting.occurrences <= document_table.GetWordCount(ordinal);
+        };
+        for (uint64_t i = 0; i < header.term_count; ++i) {
+            const auto& term = terms[i];
+            if (term.first_block > header.block_count || term.block_count > header.block_count - term.first_block
+                || term.first_byte > header.posting_byte_count || term.byte_count > header.posting_byte_count - term.first_byte) {
+                throw runtime_error("Corrupted index file"s);
+            }
+            const string_view word = get_word(term.word);
+            const auto [it, inserted] = search_server.word_to_document_freqs_.try_emplace(
+                    word, search_server.index_resource_.get());
+            auto& posting_list = it->second;
+            if (!inserted || !posting_list.postings.Assign(blocks + term.first_block, term.block_count,
+                                                           posting_bytes + term.first_byte, term.byte_count,
+                                                           is_valid_posting)) {
+                throw runtime_error("Corrupted index file"s);
+            }
+            posting_list.max_term_freq = term.max_term_freq;
+        }
+        search_server.document_words_loading_ = make_unique<once_flag>();
+        return search_server;
+    }
+    
+    const pmr::map<string_view, double>& GetWordFrequencies(int document_id) const {
+        static const pmr::map<string_view, double> empty_word_freqs;
+        LoadDocumentWords();
+        const auto it = document_to_word_freqs_.find(document_id);
+        return it == document_to_word_freqs_.end() ? empty_word_freqs : it->second;
+    }
+    
+    // Matched words are sorted, unique and point into the index, so they outlive the query
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        return MatchDocument(execution::seq, raw_query, document_id);
+    }
+    
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(const execution::sequenced_policy&,
+                                                             string_view raw_query, int document_id) const {
+        PROFILE_OPERATION("MatchDocument"sv);
+        const auto query = ParseQueryTimed(raw_query);
+        const int ordinal = documents_.GetOrdinal(document_id);
+        return {MatchQueryWords(execution::seq, query, ordinal), documents_.GetStatus(ordinal)};
+    }
+    
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(const execution::parallel_policy&,
+                                                             string_view raw_query, int document_id) const {
+        PROFILE_OPERATION("MatchDocument"sv);
+        const auto query = ParseQueryTimed(raw_query);
+        const int ordinal = documents_.GetOrdinal(document_id);
+        if (query.plus_words.size() + query.minus_words.size() < PARALLEL_MATCH_MIN_WORD_COUNT) {
+            return {MatchQueryWords(execution::seq, query, ordinal), documents_.GetStatus(ordinal)};
+        }
+        return {MatchQueryWords(execution::par, query, ordinal), documents_.GetStatus(ordinal)};
+    }
+
+private:
+    // Document attributes stored column by column and addressed by a dense ordinal. Posting lists
+    // refer to documents by ordinal, so scoring fetches what the predicate needs with indexed loads.
+    // A new document always gets the next ordinal, so its postings are appended to the lists.
+    // Ordinals of removed documents keep the id -1 until Compact renumbers the table.
+    class DocumentTable {
+    public:
+        explicit DocumentTable(pmr::memory_resource* resource)
+                : ids_(resource)
+                , ratings_(resource)
+                , statuses_(resource)
+                , word_counts_(resource)
+                , inverse_word_counts_(resource)
+                , ordinals_(resource) {
+        }
+        
+        int Add(int document_id, int rating, DocumentStatus status, int word_count) {
+            const int ordinal = GetOrdinalCount();
+            ids_.push_back(document_id);
+            ratings_.push_back(rating);
+            statuses_.push_back(status);
+            word_counts_.push_back(word_count);
+            inverse_word_counts_.push_back(word_count > 0 ? 1.0 / word_count : 0.0);
+            ordinals_.emplace(document_id, ordinal);
+            return ordinal;
+        }
+        
+        // Keeps the place of a removed document when a saved table is restored
+        void AddFreeOrdinal() {
+            ids_.push_back(-1);
+            ratings_.push_back(0);
+            statuses_.push_back(DocumentStatus::REMOVED);
+            word_counts_.push_back(0);
+            inverse_word_counts_.push_back(0.0);
+            ++free_ordinal_count_;
+        }
+        
+        void Remove(int document_id) {
+            const auto it = ordinals_.find(document_id);
+            if (it == ordinals_.end()) {
+                return;
+            }
+            ids_[it->second] = -1;
+            ++free_ordinal_count_;
+            ordinals_.erase(it);
+        }
+        
+        // Drops free ordinals and returns the new ordinal of every old one, -1 for a free one.
+        // Documents keep their relative order.
+        vector<int> Compact() {
+            vector<int> new_ordinals(ids_.size(), -1);
+            int ordinal_count = 0;
+            for (size_t ordinal = 0; ordinal < ids_.size(); ++ordinal) {
+                if (ids_[ordinal] == -1) {
+                    continue;
+                }
+                new_ordinals[ordinal] = ordinal_count;
+                ids_[ordinal_count] = ids_[ordinal];
+                ratings_[ordinal_count] = ratings_[ordinal];
+                statuses_[ordinal_count] = statuses_[ordinal];
+                word_counts_[ordinal_count] = word_counts_[ordinal];
+                inverse_word_counts_[ordinal_count] = inverse_word_counts_[ordinal];
+                ordinals_[ids_[ordinal]] = ordinal_count;
+                ++ordinal_count;
+            }
+            ids_.resize(ordinal_count);
+            ratings_.resize(ordinal_count);
+            statuses_.resize(ordinal_count);
+            word_counts_.resize(ordinal_count);
+            inverse_word_counts_.resize(ordinal_count);
+            free_ordinal_count_ = 0;
+            return new_ordinals;
+        }
+        
+        bool Contains(int document_id) const {
+            return ordinals_.count(document_id) > 0;
+        }
+        
+        // Throws out_of_range for an unknown document
+        int GetOrdinal(int document_id) const {
+            return ordinals_.at(document_id);
+        }
+        
+        int size() const {
+            return static_cast<int>(ordinals_.size());
+        }
+        
+        // Including free ordinals
+        int GetOrdinalCount() const {
+            return static_cast<int>(ids_.size());
+        }
+        
+        int GetFreeOrdinalCount() const {
+            return free_ordinal_count_;
+        }
+        
+        int GetId(int ordinal) const {
+            return ids_[ordinal];
+        }
+        
+        int GetRating(int ordinal) const {
+            return ratings_[ordinal];
+        }
+        
+        DocumentStatus GetStatus(int ordinal) const {
+            return statuses_[ordinal];
+        }
+        
+        int GetWordCount(int ordinal) const {  // without stop words
+            return word_counts_[ordinal];
+        }
+        
+        // Zero for a document without words
+        double GetInverseWordCount(int ordinal) const {
+            return inverse_word_counts_[ordinal];
+        }
+    
+    private:
+        pmr::vector<int> ids_;
+        pmr::vector<int> ratings_;
+        pmr::vector<DocumentStatus> statuses_;
+        pmr::vector<int> word_counts_;
+        pmr::vector<double> inverse_word_counts_;
+        pmr::unordered_map<int, int> ordinals_;
+        int free_ordinal_count_ = 0;
+    };
+    
+    // Inverse document frequency of a word, computed lazily and kept until index_epoch_ changes.
+    // Concurrent queries may fill it at the same time, but they all compute the same value
+    // for the same epoch, so publishing it through atomics is enough.
+    class InverseDocumentFreqCache {
+    public:
+        InverseDocumentFreqCache() = default;
+        
+        InverseDocumentFreqCache(const InverseDocumentFreqCache& other)
+                : value_(other.value_.load(memory_order_relaxed))
+                , epoch_(other.epoch_.load(memory_order_relaxed)) {
+        }
+        
+        template <typename Compute>
+        double Get(uint64_t epoch, Compute compute) const {
+            if (epoch_.load(memory_order_acquire) == epoch) {
+                return value_.load(memory_order_relaxed);
+            }
+            const double value = compute();
+            value_.store(value, memory_order_relaxed);
+            epoch_.store(epoch, memory_order_release);
+            return value;
+        }
+    
+    private:
+        mutable atomic<double> value_{0.0};
+        mutable atomic<uint64_t> epoch_{0};
+    };
+    
+    struct PostingList {
+        explicit PostingList(pmr::memory_resource* resource)
+                : postings(resource) {
+        }
+        
+        CompressedPostings postings;
+        // Upper bound of the word's contribution to relevance is max_term_freq * IDF
+        double max_term_freq = 0.0;
+        InverseDocumentFreqCache inverse_document_freq;
+    };
+    
+    // Everything the index allocates comes from this pool: the nodes of the containers below,
+    // the compressed posting lists and the columns of the document table. Memory of removed
+    // documents is reused by new ones, and the whole index is returned in large chunks. Batches and
+    // compaction grow different posting lists from several threads, so the pool is synchronized.
+    // Being held by pointer, it stays in place when the server is moved.
+    unique_ptr<pmr::synchronized_pool_resource> index_resource_ = make_unique<pmr::synchronized_pool_resource>();
+    const StopWordSet stop_words_;
+    // Owns the only copy of every indexed word, posting lists refer to it by string_view
+    pmr::set<pmr::string, less<>> words_{index_resource_.get()};
+    // Keeps the words of an index loaded by OpenIndex alive
+    shared_ptr<const MappedFile> mapped_index_;
+    pmr::unordered_map<string_view, PostingList> word_to_document_freqs_{index_resource_.get()};
+    // Changes whenever the set of documents changes, which invalidates cached IDF values
+    uint64_t index_epoch_ = 1;
+    // Cleared together with every change of index_epoch_
+    mutable QueryCache query_cache_{QUERY_CACHE_CAPACITY};
+    mutable QueryStats query_stats_;
+    // Filled lazily by LoadDocumentWords for the documents of an opened index
+    mutable pmr::map<int, pmr::map<string_view, double>> document_to_word_freqs_{index_resource_.get()};
+    // Set by OpenIndex until the word frequencies of the loaded documents are collected
+    mutable unique_ptr<once_flag> document_words_loading_;
+    DocumentTable documents_{index_resource_.get()};
+    pmr::set<int> document_ids_{index_resource_.get()};
+    int max_result_document_count_ = MAX_RESULT_DOCUMENT_COUNT;
+    ScoringMode scoring_mode_ = ScoringMode::EXHAUSTIVE;
+    
+    bool IsNewDocumentId(int document_id) const {
+        return document_id >= 0 && !documents_.Contains(document_id);
+    }
+    
+    struct DocumentWords {
+        explicit DocumentWords(pmr::memory_resource* resource)
+                : word_counts(resource) {
+        }
+        
+        pmr::map<string_view, int> word_counts;  // word views point into the document text
+        int word_count = 0;  // without stop words
+    };
+    
+    // Words are counted straight from the text, the nodes of the counts come from resource
+    DocumentWords CountWords(string_view text, pmr::memory_resource* resource) const {
+        DocumentWords document_words(resource);
+        ForEachWord(text, [this, &document_words](string_view word, bool is_valid) {
+            if (!is_valid) {
+                throw invalid_argument("Word "s + string(word) + " is invalid"s);
+            }
+            if (!IsStopWord(word)) {
+                ++document_words.word_counts[word];
+                ++document_words.word_count;
+            }
+        });
+        return document_words;
+    }
+    
+    // Postings keep the number of occurrences instead of the term frequency. The frequency is
+    // restored with the inverse word count of the document, which the document table keeps,
+    // so every posting costs a single multiplication.
+    static double ComputeTermFreq(int occurrences, double inverse_word_count) {
+        return occurrences * inverse_word_count;
+    }
+    
+    // The order of documents does not change, so every posting list is rebuilt by appending
+    template <typename ExecutionPolicy>
+    void CompactOrdinals(ExecutionPolicy&& policy) {
+        const vector<int> new_ordinals = documents_.Compact();
+        vector<PostingList*> posting_lists;
+        posting_lists.reserve(word_to_document_freqs_.size());
+        for (auto& [_, posting_list] : word_to_document_freqs_) {
+            posting_lists.push_back(&posting_list);
+        }
+        for_each(policy, posting_lists.begin(), posting_lists.end(),
+                 [this, &new_ordinals](PostingList* posting_list) {
+                     CompressedPostings postings(index_resource_.get());
+                     posting_list->postings.ForEach([&postings, &new_ordinals](const Posting& posting) {
+                         postings.Add({new_ordinals[posting.document_id], posting.occurrences});
+                     });
+                     posting_list->postings = move(postings);
+                 });
+    }
+    
+    // Rebuilds the word frequencies of the documents loaded by OpenIndex from the posting lists.
+    // Postings are grouped by ordinal first, so every document map is filled in one go rather
+    // than visited once per word. Documents added since then already have their frequencies.
+    void LoadDocumentWords() const {
+        if (!document_words_loading_) {
+            return;
+        }
+        call_once(*document_words_loading_, [this] {
+            vector<string_view> words;
+            words.reserve(word_to_document_freqs_.size());
+            vector<size_t> group_begins(documents_.GetOrdinalCount() + 1, 0);
+            for (const auto& [word, posting_list] : word_to_document_freqs_) {
+                words.push_back(word);
+                posting_list.postings.ForEach([&group_begins](const Posting& posting) {
+                    ++group_begins[posting.document_id + 1];
+                });
+            }
+            partial_sum(group_begins.begin(), group_begins.end(), group_begins.begin());
+            
+            // Pairs of a word index and the number of its occurrences, grouped by ordinal
+            vector<pair<uint32_t, int>> document_words(group_begins.back());
+            vector<size_t> group_ends(group_begins.begin(), group_begins.end() - 1);
+            uint32_t word_index = 0;
+            for (const auto& [_, posting_list] : word_to_document_freqs_) {
+                posting_list.postings.ForEach([&, word_index](const Posting& posting) {
+                    document_words[group_ends[posting.document_id]++] = {word_index, posting.occurrences};
+                });
+                ++word_index;
+            }
+            
+            for (const int document_id : document_ids_) {
+                const int ordinal = documents_.GetOrdinal(document_id);
+                const auto group_begin = document_words.begin() + group_begins[ordinal];
+                const auto group_end = document_words.begin() + group_begins[ordinal + 1];
+                sort(group_begin, group_end, [&words](const auto& lhs, const auto& rhs) {
+                    return words[lhs.first] < words[rhs.first];
+                });
+                auto& word_freqs = document_to_word_freqs_.try_emplace(document_to_word_freqs_.end(), document_id)->second;
+                for (auto it = group_begin; it != group_end; ++it) {
+                    word_freqs.emplace_hint(word_freqs.end(), words[it->first],
+                                            ComputeTermFreq(it->second, documents_.GetInverseWordCount(ordinal)));
+                }
+            }
+        });
+    }
+    
+    // Adds everything about a document except its postings and returns the postings
+    // together with the lists they must be added to
+    vector<pair<PostingList*, Posting>> RegisterDocument(int document_id, const DocumentWords& document_words,
+                                                         DocumentStatus status, const vector<int>& ratings) {
+        const int ordinal = documents_.Add(document_id, ComputeAverageRating(ratings), status, document_words.word_count);
+        vector<pair<PostingList*, Posting>> postings;
+        postings.reserve(document_words.word_counts.size());
+        auto& document_word_freqs = document_to_word_freqs_[document_id];
+        for (const auto [word, occurrences] : document_words.word_counts) {
+            auto& [stored_word, posting_list] = *GetOrAddPostingList(word);
+            const double term_freq = ComputeTermFreq(occurrences, documents_.GetInverseWordCount(ordinal));
+            posting_list.max_term_freq = max(posting_list.max_term_freq, term_freq);
+            document_word_freqs.emplace(stored_word, term_freq);
+            postings.push_back({&posting_list, {ordinal, occurrences}});
+        }
+        document_ids_.insert(document_id);
+        ++index_epoch_;
+        query_cache_.Clear();
+        return postings;
+    }
+    
+    pmr::unordered_map<string_view, PostingList>::iterator GetOrAddPostingList(string_view word) {
+        const auto it = word_to_document_freqs_.find(word);
+        if (it != word_to_document_freqs_.end()) {
+            return it;
+        }
+        const string_view stored_word = *words_.emplace(word).first;
+        return word_to_document_freqs_.try_emplace(stored_word, index_resource_.get()).first;
+    }
+    
+    bool IsStopWord(string_view word) const {
+        return stop_words_.Contains(word);
+    }
+    
+    static bool IsValidWord(string_view word) {
+        // A valid word must not contain special characters
+        return none_of(word.begin(), word.end(), IsControlChar);
+    }
+    
+    static int ComputeAverageRating(const vector<int>& ratings) {
+        if (ratings.empty()) {
+            return 0;
+        }
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+        return rating_sum / static_cast<int>(ratings.size());
+    }
+    
+    struct QueryWord {
+        string_view data;
+        bool is_minus;
+        bool is_stop;
+    };
+    
+    // is_valid is the control character check already done by ForEachWord
+    QueryWord ParseQueryWord(string_view text, bool is_valid) const {
+        if (text.empty()) {
+            throw invalid_argument("Query word is empty"s);
+        }
+        string_view word = text;
+        bool is_minus = false;
+        if (word[0] == '-') {
+            is_minus = true;
+            word.remove_prefix(1);
+        }
+        if (word.empty() || word[0] == '-' || !is_valid) {
+            throw invalid_argument("Query word "s + string(text) + " is invalid");
+        }
+        
+        return {word, is_minus, IsStopWord(word)};
+    }
+    
+    // Words are sorted and unique, they point into the raw query text
+    struct Query {
+        vector<string_view> plus_words;
+        vector<string_view> minus_words;
+    };
+    
+    static void SortUnique(vector<string_view>& words) {
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+    }
+    
+    Query ParseQuery(string_view text) const {
+        Query result;
+        ForEachWord(text, [this, &result](string_view word, bool is_valid) {
+            const auto query_word = ParseQueryWord(word, is_valid);
+            if (!query_word.is_stop) {
+                if (query_word.is_minus) {
+                    result.minus_words.push_back(query_word.data);
+                } else {
+                    result.plus_words.push_back(query_word.data);
+                }
+            }
+        });
+        SortUnique(result.plus_words);
+        SortUnique(result.minus_words);
+        return result;
+    }
+    
+    // Query words are already sorted and unique, so equal queries get equal keys
+    static string MakeQueryCacheKey(const Query& query, const string& filter_key) {
+        string key = filter_key;
+        for (const string_view word : query.plus_words) {
+            key += ' ';
+            key += word;
+        }
+        for (const string_view word : query.minus_words) {
+            key += " -"s;
+            key += word;
+        }
+        return key;
+    }
+    
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindCachedTopDocuments(ExecutionPolicy&& policy, const Query& query, const string& filter_key,
+                                            DocumentPredicate document_predicate) const {
+        string key = MakeQueryCacheKey(query, filter_key);
+        if (auto cached_documents = query_cache_.Find(key)) {
+            return move(*cached_documents);
+        }
+        auto documents = FindAllDocuments(policy, query, document_predicate);
+        query_cache_.Insert(move(key), documents);
+        return documents;
+    }
+    
+    double ComputeWordInverseDocumentFreq(const PostingList& posting_list) const {
+        return posting_list.inverse_document_freq.Get(index_epoch_, [this, &posting_list] {
+            return log(GetDocumentCount() * 1.0 / posting_list.postings.size());
+        });
+    }
+    
+    // The indexed copy of the word if the document contains it, an empty view otherwise
+    string_view FindDocumentWord(string_view word, int ordinal) const {
+        const auto it = word_to_document_freqs_.find(word);
+        if (it == word_to_document_freqs_.end() || !it->second.postings.Contains(ordinal)) {
+            return {};
+        }
+        return it->first;
+    }
+    
+    // Minus words are checked first, so a document they exclude costs no plus word lookups.
+    // Plus words of a query are already sorted and unique, which keeps the result sorted.
+    template <typename ExecutionPolicy>
+    vector<string_view> MatchQueryWords(ExecutionPolicy&& policy, const Query& query, int ordinal) const {
+        const bool is_excluded = any_of(policy, query.minus_words.begin(), query.minus_words.end(),
+                                        [this, ordinal](string_view word) {
+                                            return !FindDocumentWord(word, ordinal).empty();
+                                        });
+        if (is_excluded) {
+            return {};
+        }
+        
+        vector<string_view> matched_words(query.plus_words.size());
+        transform(policy, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(),
+                  [this, ordinal](string_view word) {
+                      return FindDocumentWord(word, ordinal);
+                  });
+        matched_words.erase(remove_if(matched_words.begin(), matched_words.end(),
+                                      [](string_view word) {
+                                          return word.empty();
+                                      }), matched_words.end());
+        return matched_words;
+    }
+    
+    Query ParseQueryTimed(string_view raw_query) const {
+        QueryStageTimer timer(query_stats_, QueryStage::PARSE);
+        return ParseQuery(raw_query);
+    }
+    
+    // Documents containing any of the minus words, built before scoring so they are never accumulated
+    DocumentIdBitmap FindExcludedDocuments(const Query& query) const {
+        QueryStageTimer timer(query_stats_, QueryStage::MINUS_WORDS);
+        DocumentIdBitmap excluded_documents;
+        for (const string_view word : query.minus_words) {
+            const auto it = word_to_document_freqs_.find(word);
+            if (it == word_to_document_freqs_.end()) {
+                continue;
+            }
+            it->second.postings.ForEach([&excluded_documents](const Posting& posting) {
+                excluded_documents.Add(posting.document_id);
+            });
+        }
+        return excluded_documents;
+    }
+    
+    // Recognized predicates read only the columns they need, any other one is called
+    // with the id, status and rating of the document
+    template <typename DocumentPredicate>
+    auto MakeOrdinalFilter(DocumentPredicate& document_predicate) const {
+        if constexpr (is_same_v<DocumentPredicate, StatusEquals>) {
+            return [this, status = document_predicate.status](int ordinal) {
+                return documents_.GetStatus(ordinal) == status;
+            };
+        } else if constexpr (is_same_v<DocumentPredicate, RatingRange>) {
+            return [this, range = document_predicate](int ordinal) {
+                const int rating = documents_.GetRating(ordinal);
+                return range.min_rating <= rating && rating <= range.max_rating;
+            };
+        } else if constexpr (is_same_v<DocumentPredicate, DocumentIdSet>) {
+            DocumentIdBitmap ordinals;
+            for (const int document_id : document_predicate.GetDocumentIds()) {
+                if (documents_.Contains(document_id)) {
+                    ordinals.Add(documents_.GetOrdinal(document_id));
+                }
+            }
+            return [ordinals = move(ordinals)](int ordinal) {
+                return ordinals.Contains(ordinal);
+            };
+        } else {
+            return [this, &document_predicate](int ordinal) {
+                return document_predicate(documents_.GetId(ordinal), documents_.GetStatus(ordinal),
+                                          documents_.GetRating(ordinal));
+            };
+        }
+    }
+    
+    // A lookup of a document in a posting list decodes at most one block, so it pays off
+    // when the lookups together decode less than scanning the whole lists
+    bool IsSmallDocumentIdSet(const Query& query, const DocumentIdSet& document_ids) const {
+        size_t posting_count = 0;
+        for (const string_view word : query.plus_words) {
+            const auto it = word_to_document_freqs_.find(word);
+            if (it != word_to_document_freqs_.end()) {
+                posting_count += it->second.postings.size();
+            }
+        }
+        return document_ids.GetDocumentIds().size() * query.plus_words.size() * CompressedPostings::BLOCK_SIZE
+               < posting_count;
+    }
+    
+    // Scores only the given documents. Every document sums its relevance word by word
+    // in the same order as the scan over posting lists does.
+    vector<Document> FindDocumentsByIds(const Query& query, const DocumentIdSet& document_ids) const {
+        vector<pair<const PostingList*, double>> plus_posting_lists;
+        for (const string_view word : query.plus_words) {
+            const auto it = word_to_document_freqs_.find(word);
+            if (it != word_to_document_freqs_.end()) {
+                plus_posting_lists.push_back({&it->second, ComputeWordInverseDocumentFreq(it->second)});
+            }
+        }
+        vector<const PostingList*> minus_posting_lists;
+        for (const string_view word : query.minus_words) {
+            const auto it = word_to_document_freqs_.find(word);
+            if (it != word_to_document_freqs_.end()) {
+                minus_posting_lists.push_back(&it->second);
+            }
+        }
+        
+        map<int, double> ordinal_to_relevance;
+        uint64_t postings_visited = 0;
+        {
+            QueryStageTimer timer(query_stats_, QueryStage::SCORING);
+            for (const int document_id : document_ids.GetDocumentIds()) {
+                if (!documents_.Contains(document_id)) {
+                    continue;
+                }
+                const int ordinal = documents_.GetOrdinal(document_id);
+                const bool is_excluded = any_of(minus_posting_lists.begin(), minus_posting_lists.end(),
+                                                [ordinal](const PostingList* posting_list) {
+                                                    return posting_list->postings.Contains(ordinal);
+                                                });
+                if (is_excluded) {
+                    continue;
+                }
+                postings_visited += plus_posting_lists.size();
+                for (const auto& [posting_list, inverse_document_freq] : plus_posting_lists) {
+                    const int occurrences = posting_list->postings.GetOccurrences(ordinal);
+                    if (occurrences > 0) {
+                        const double term_freq = ComputeTermFreq(occurrences, documents_.GetInverseWordCount(ordinal));
+                        ordinal_to_relevance[ordinal] += term_freq * inverse_document_freq;
+                    }
+                }
+            }
+        }
+        query_stats_.AddQuery(postings_visited, ordinal_to_relevance.size());
+        return SelectTopDocuments(ordinal_to_relevance);
+    }
+    
+    template <typename DocumentPredicate>
+    vector<Document> FindAllDocuments(const execution::sequenced_policy&, const Query& query,
+                                      DocumentPredicate document_predicate) const {
+        if constexpr (is_same_v<DocumentPredicate, DocumentIdSet>) {
+            if (IsSmallDocumentIdSet(query, document_predicate)) {
+                return FindDocumentsByIds(query, document_predicate);
+            }
+        }
+        if (scoring_mode_ == ScoringMode::WAND) {
+            return FindTopDocumentsWand(query, document_predicate);
+        }
+        const auto is_accepted = MakeOrdinalFilter(document_predicate);
+        const DocumentIdBitmap excluded_documents = FindExcludedDocuments(query);
+        map<int, double> document_to_relevance;
+        uint64_t postings_visited = 0;
+        {
+            QueryStageTimer timer(query_stats_, QueryStage::SCORING);
+            for (const string_view word : query.plus_words) {
+                const auto it = word_to_document_freqs_.find(word);
+                if (it == word_to_document_freqs_.end()) {
+                    continue;
+                }
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(it->second);
+                postings_visited += it->second.postings.size();
+                it->second.postings.ForEach([&](const Posting& posting) {
+                    const int ordinal = posting.document_id;
+                    if (excluded_documents.Contains(ordinal)) {
+                        return;
+                    }
+                    if (is_accepted(ordinal)) {
+                        const double term_freq = ComputeTermFreq(posting.occurrences, documents_.GetInverseWordCount(ordinal));
+                        document_to_relevance[ordinal] += term_freq * inverse_document_freq;
+                    }
+                });
+            }
+        }
+        query_stats_.AddQuery(postings_visited, document_to_relevance.size());
+        
+        return SelectTopDocuments(document_to_relevance);
+    }
+    
+    // Words are scored one after another, so every document accumulates its relevance
+    // in the same order as in the sequential version; only the posting blocks of a word are
+    // spread across threads
+    template <typename DocumentPredicate>
+    vector<Document> FindAllDocuments(const execution::parallel_policy&, const Query& query,
+                                      DocumentPredicate document_predicate) const {
+        if constexpr (is_same_v<DocumentPredicate, DocumentIdSet>) {
+            if (IsSmallDocumentIdSet(query, document_predicate)) {
+                return FindDocumentsByIds(query, document_predicate);
+            }
+        }
+        const auto is_accepted = MakeOrdinalFilter(document_predicate);
+        const DocumentIdBitmap excluded_documents = FindExcludedDocuments(query);
+        map<int, double> ordinal_to_relevance;
+        uint64_t postings_visited = 0;
+        {
+            QueryStageTimer timer(query_stats_, QueryStage::SCORING);
+            ConcurrentMap<int, double> document_to_relevance(RELEVANCE_BUCKET_COUNT);
+            for (const string_view word : query.plus_words) {
+                const auto it = word_to_document_freqs_.find(word);
+                if (it == word_to_document_freqs_.end()) {
+                    continue;
+                }
+                const double inverse_document_freq = ComputeWordInverseDocumentFreq(it->second);
+                postings_visited += it->second.postings.size();
+                it->second.postings.ForEach(execution::par, [&](const Posting& posting) {
+                    const int ordinal = posting.document_id;
+                    if (excluded_documents.Contains(ordinal)) {
+                        return;
+                    }
+                    if (is_accepted(ordinal)) {
+                        const double term_freq = ComputeTermFreq(posting.occurrences, documents_.GetInverseWordCount(ordinal));
+                        document_to_relevance[ordinal].ref_to_value += term_freq * inverse_document_freq;
+                    }
+                });
+            }
+            ordinal_to_relevance = document_to_relevance.BuildOrdinaryMap();
+        }
+        query_stats_.AddQuery(postings_visited, ordinal_to_relevance.size());
+        
+        return SelectTopDocuments(ordinal_to_relevance);
+    }
+    
+    // Documents with equal relevance and rating are ordered by id to keep the result stable
+    static bool IsMoreRelevant(const Document& lhs, const Document& rhs) {
+        if (abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON) {
+            if (lhs.rating != rhs.rating) {
+                return lhs.rating > rhs.rating;
+            }
+            return lhs.id < rhs.id;
+        }
+        return lhs.relevance > rhs.relevance;
+    }
+    
+    // Keeps the best max_count documents in a heap whose top is the least relevant one
+    class TopDocuments {
+    public:
+        explicit TopDocuments(size_t max_count)
+                : max_count_(max_count) {
+        }
+        
+        bool IsFull() const {
+            return documents_.size() == max_count_;
+        }
+        
+        // The least relevant of the kept documents, requires a non-empty heap
+        const Document& GetWorst() const {
+            return documents_.front();
+        }
+        
+        void Add(const Document& document) {
+            if (max_count_ == 0) {
+                return;
+            }
+            if (documents_.size() < max_count_) {
+                documents_.push_back(document);
+                push_heap(documents_.begin(), documents_.end(), IsMoreRelevant);
+            } else if (IsMoreRelevant(document, documents_.front())) {
+                pop_heap(documents_.begin(), documents_.end(), IsMoreRelevant);
+                documents_.back() = document;
+                push_heap(documents_.begin(), documents_.end(), IsMoreRelevant);
+            }
+        }
+        
+        vector<Document> Extract() {
+            sort_heap(documents_.begin(), documents_.end(), IsMoreRelevant);
+            return move(documents_);
+        }
+    
+    private:
+        size_t max_count_;
+        vector<Document> documents_;
+    };
+    
+    vector<Document> SelectTopDocuments(const map<int, double>& ordinal_to_relevance) const {
+        QueryStageTimer timer(query_stats_, QueryStage::SELECTION);
+        TopDocuments top_documents(max_result_document_count_);
+        for (const auto [ordinal, relevance] : ordinal_to_relevance) {
+            top_documents.Add({documents_.GetId(ordinal), relevance, documents_.GetRating(ordinal)});
+        }
+        return top_documents.Extract();
+    }
+    
+    struct TermCursor {
+        CompressedPostings::Cursor cursor;
+        double inverse_document_freq;
+        double max_relevance;
+        size_t word_index;  // position of the word in Query::plus_words
+    };
+    
+    // Document-at-a-time scoring with WAND dynamic pruning. Cursors are kept sorted by their
+    // current document; the pivot is the first cursor at which the sum of upper bounds could beat
+    // the worst kept document, and cursors before it jump straight to the pivot document.
+    // Relevance of a scored document is summed in the order of plus words, exactly as
+    // the exhaustive path does, so both paths return the same documents.
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocumentsWand(const Query& query, DocumentPredicate document_predicate) const {
+        TopDocuments top_documents(max_result_document_count_);
+        if (max_result_document_count_ == 0) {
+            return top_documents.Extract();
+        }
+        
+        vector<TermCursor> cursors;
+        for (size_t word_index = 0; word_index < query.plus_words.size(); ++word_index) {
+            const auto it = word_to_document_freqs_.find(query.plus_words[word_index]);
+            if (it == word_to_document_freqs_.end() || it->second.postings.empty()) {
+                continue;
+            }
+            const auto& posting_list = it->second;
+            const double inverse_document_freq = ComputeWordInverseDocumentFreq(posting_list);
+            cursors.push_back({CompressedPostings::Cursor(posting_list.postings), inverse_document_freq,
+                               posting_list.max_term_freq * inverse_document_freq, word_index});
+        }
+        const DocumentIdBitmap excluded_documents = FindExcludedDocuments(query);
+        const auto is_accepted = MakeOrdinalFilter(document_predicate);
+        
+        uint64_t postings_visited = 0;
+        uint64_t matched_documents = 0;
+        {
+            QueryStageTimer timer(query_stats_, QueryStage::SCORING);
+            vector<const TermCursor*> pivot_cursors;
+            while (!cursors.empty()) {
+                sort(cursors.begin(), cursors.end(), [](const TermCursor& lhs, const TermCursor& rhs) {
+                    return lhs.cursor.Get().document_id < rhs.cursor.Get().document_id;
+                });
+                
+                // A document can only enter when it is within the epsilon of the worst kept one,
+                // the extra epsilon covers rounding in the sum of upper bounds
+                const double min_relevance = top_documents.IsFull()
+                                             ? top_documents.GetWorst().relevance - 2 * RELEVANCE_EPSILON
+                                             : -numeric_limits<double>::infinity();
+                double max_relevance = 0.0;
+                size_t pivot = 0;
+                while (pivot < cursors.size()) {
+                    max_relevance += cursors[pivot].max_relevance;
+                    if (max_relevance > min_relevance) {
+                        break;
+                    }
+                    ++pivot;
+                }
+                if (pivot == cursors.size()) {
+                    break;
+                }
+                
+                const int pivot_ordinal = cursors[pivot].cursor.Get().document_id;
+                if (cursors.front().cursor.Get().document_id == pivot_ordinal) {
+                    pivot_cursors.clear();
+                    for (const TermCursor& term_cursor : cursors) {
+                        if (term_cursor.cursor.Get().document_id != pivot_ordinal) {
+                            break;
+                        }
+                        pivot_cursors.push_back(&term_cursor);
+                    }
+                    if (!excluded_documents.Contains(pivot_ordinal) && is_accepted(pivot_ordinal)) {
+                        sort(pivot_cursors.begin(), pivot_cursors.end(), [](const TermCursor* lhs, const TermCursor* rhs) {
+                            return lhs->word_index < rhs->word_index;
+                        });
+                        double relevance = 0.0;
+                        for (const TermCursor* term_cursor : pivot_cursors) {
+                            relevance += ComputeTermFreq(term_cursor->cursor.Get().occurrences,
+                                                         documents_.GetInverseWordCount(pivot_ordinal))
+                                         * term_cursor->inverse_document_freq;
+                        }
+                        top_documents.Add({documents_.GetId(pivot_ordinal), relevance, documents_.GetRating(pivot_ordinal)});
+                        ++matched_documents;
+                    }
+                    postings_visited += pivot_cursors.size();
+                    for (size_t i = 0; i < pivot_cursors.size(); ++i) {
+                        cursors[i].cursor.Next();
+                    }
+                } else {
+                    for (size_t i = 0; i < pivot; ++i) {
+                        cursors[i].cursor.SkipTo(pivot_ordinal);
+                    }
+                    postings_visited += pivot;
+                }
+                cursors.erase(remove_if(cursors.begin(), cursors.end(), [](const TermCursor& term_cursor) {
+                    return term_cursor.cursor.IsEnd();
+                }), cursors.end());
+            }
+        }
+        query_stats_.AddQuery(postings_visited, matched_documents);
+        
+        QueryStageTimer timer(query_stats_, QueryStage::SELECTION);
+        return top_documents.Extract();
+    }
+};
+
+vector<vector<Document>> ProcessQueries(const SearchServer& search_server, const vector<string>& queries) {
+    vector<vector<Document>> documents_lists(queries.size());
+    transform(execution::par, queries.begin(), queries.end(), documents_lists.begin(),
+              [&search_server](const string& query) {
+                  return search_server.FindTopDocuments(query);
+              });
+    return documents_lists;
+}
+
+// Queries are run in parallel a chunk at a time. Every query of a chunk writes its results into
+// its own slot after the documents joined so far, a slot holds as many documents as a query
+// can return; the slots are then moved together in input order. So the results of the queries
+// are never kept as separate vectors, and the unused slots take at most JOINED_QUERIES_SLOT_SPACE
+// documents at any time.
+vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const vector<string>& queries) {
+    const size_t slot_size = static_cast<size_t>(min(search_server.GetMaxResultDocumentCount(),
+                                                     search_server.GetDocumentCount()));
+    vector<Document> documents;
+    if (slot_size == 0) {
+        return documents;
+    }
+    const size_t chunk_size = max<size_t>(JOINED_QUERIES_SLOT_SPACE / slot_size, 1);
+    vector<size_t> document_counts(min(chunk_size, queries.size()));
+    vector<size_t> query_indexes(document_counts.size());
+    for (size_t chunk_begin = 0; chunk_begin < queries.size(); chunk_begin += chunk_size) {
+        const size_t chunk_end = min(chunk_begin + chunk_size, queries.size());
+        const size_t joined_size = documents.size();
+        documents.resize(joined_size + (chunk_end - chunk_begin) * slot_size);
+        query_indexes.resize(chunk_end - chunk_begin);
+        iota(query_indexes.begin(), query_indexes.end(), 0);
+        for_each(execution::par, query_indexes.begin(), query_indexes.end(),
+                 [&](size_t index) {
+                     const auto query_documents = search_server.FindTopDocuments(queries[chunk_begin + index]);
+                     move(query_documents.begin(), query_documents.end(), documents.begin() + joined_size + index * slot_size);
+                     document_counts[index] = query_documents.size();
+                 });
+        
+        auto joined_end = documents.begin() + joined_size;
+        for (const size_t index : query_indexes) {
+            const auto slot_begin = documents.begin() + joined_size + index * slot_size;
+            joined_end = move(slot_begin, slot_begin + document_counts[index], joined_end);
+        }
+        documents.erase(joined_end, documents.end());
+    }
+    return documents;
+}
+
+// Documents are fingerprinted by a hash of their sorted word set, full word sets are
+// compared only when fingerprints collide. Ids are visited in ascending order,
+// so the lowest id of every group of duplicates is kept. Returns the removed ids in ascending order.
+vector<int> RemoveDuplicates(SearchServer& search_server) {
+    const auto has_same_words = [](const pmr::map<string_view, double>& lhs, const pmr::map<string_view, double>& rhs) {
+        return equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                     [](const auto& lhs_word_freq, const auto& rhs_word_freq) {
+                         return lhs_word_freq.first == rhs_word_freq.first;
+                     });
+    };
+    
+    unordered_map<size_t, vector<int>> fingerprint_to_document_ids;
+    vector<int> duplicate_ids;
+    for (const int document_id : search_server) {
+        const auto& word_freqs = search_server.GetWordFrequencies(document_id);
+        size_t fingerprint = word_freqs.size();
+        for (const auto& [word, _] : word_freqs) {
+            fingerprint = fingerprint * 37 + hash<string_view>{}(word);
+        }
+        
+        auto& same_fingerprint_ids = fingerprint_to_document_ids[fingerprint];
+        const bool is_duplicate = any_of(same_fingerprint_ids.begin(), same_fingerprint_ids.end(),
+                                         [&](int original_id) {
+                                             return has_same_words(search_server.GetWordFrequencies(original_id), word_freqs);
+                                         });
+        if (is_duplicate) {
+            duplicate_ids.push_back(document_id);
+        } else {
+            same_fingerprint_ids.push_back(document_id);
+        }
+    }
+    
+    for (const int document_id : duplicate_ids) {
+        search_server.RemoveDocument(document_id);
+    }
+    return duplicate_ids;
+}
+
+// Counts requests without results among the last MIN_IN_DAY requests, one request per minute.
+// Outcomes are kept in a fixed ring buffer, so nothing is allocated per request.
+class RequestQueue {
+public:
+    explicit RequestQueue(const SearchServer& search_server)
+            : search_server_(search_server) {
+    }
+    
+    template <typename DocumentPredicate>
+    vector<Document> AddFindRequest(string_view raw_query, DocumentPredicate document_predicate) {
+        auto documents = search_server_.FindTopDocuments(raw_query, document_predicate);
+        AddRequest(documents.empty());
+        return documents;
+    }
+    
+    vector<Document> AddFindRequest(string_view raw_query, DocumentStatus status) {
+        auto documents = search_server_.FindTopDocuments(raw_query, status);
+        AddRequest(documents.empty());
+        return documents;
+    }
+    
+    vector<Document> AddFindRequest(string_view raw_query) {
+        auto documents = search_server_.FindTopDocuments(raw_query);
+        AddRequest(documents.empty());
+        return documents;
+    }
+    
+    int GetNoResultRequests() const {
+        return no_result_requests_;
+    }
+
+private:
+    static const size_t MIN_IN_DAY = 1440;
+    
+    const SearchServer& search_server_;
+    array<bool, MIN_IN_DAY> is_no_result_request_{};
+    size_t next_request_ = 0;
+    size_t request_count_ = 0;
+    int no_result_requests_ = 0;
+    
+    void AddRequest(bool is_no_result) {
+        if (request_count_ == MIN_IN_DAY) {
+            no_result_requests_ -= is_no_result_request_[next_request_];
+        } else {
+            ++request_count_;
         }
-        return matched_documents;
+        is_no_result_request_[next_request_] = is_no_result;
+        no_result_requests_ += is_no_result;
+        next_request_ = (next_request_ + 1) % MIN_IN_DAY;
     }
 };
 
@@ -360,9 +2745,12 @@ ostream& operator<<(ostream& out,const Document& document){
 
 template <typename Container>
 auto Paginate(const Container& c, size_t page_size) {
+    PROFILE_OPERATION("Paginate"sv);
     return Paginator(begin(c), end(c), page_size);
 }
 
+// Programs that only need the server, like search_server_benchmark.cpp, define SEARCH_SERVER_NO_MAIN
+#ifndef SEARCH_SERVER_NO_MAIN
 int main() {
     SearchServer search_server("and with"s);
     
@@ -382,3 +2770,4 @@ int main() {
         cout << "Page break"s << endl;
     }
 }
+#endif
@@ -0,0 +1,1127 @@
+// Assert-based tests of the search server from search_server_and_paginator.cpp.
+// Build: g++ -std=c++17 search_server_and_paginator_tests.cpp -o search_server_and_paginator_tests -ltbb -lpthread
+// Add -DSEARCH_SERVER_STATS to test the query statistics collected by the server as well.
+
+#define SEARCH_SERVER_NO_MAIN
+#include "search_server_and_paginator.cpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <random>
+#include <sstream>
+
+// Blocks allocated with plain operator new and not deleted yet
+atomic<int64_t> live_allocation_count{0};
+
+void* operator new(size_t size) {
+    void* data = malloc(size == 0 ? 1 : size);
+    if (data == nullptr) {
+        throw bad_alloc();
+    }
+    ++live_allocation_count;
+    return data;
+}
+
+// Out of line, so that the compiler does not pair the free with the operator new of the caller
+[[gnu::noinline]] void FreeCountedAllocation(void* data) noexcept {
+    if (data != nullptr) {
+        --live_allocation_count;
+        free(data);
+    }
+}
+
+void operator delete(void* data) noexcept {
+    FreeCountedAllocation(data);
+}
+
+void operator delete(void* data, size_t) noexcept {
+    FreeCountedAllocation(data);
+}
+
+// -------- Unit tests of the search server ----------
+
+vector<Posting> GetPostings(const CompressedPostings& postings) {
+    vector<Posting> result;
+    postings.ForEach([&result](const Posting& posting) {
+        result.push_back(posting);
+    });
+    return result;
+}
+
+void AssertSamePostings(const CompressedPostings& postings, const map<int, int>& expected) {
+    const vector<Posting> actual = GetPostings(postings);
+    assert(postings.size() == expected.size());
+    assert(actual.size() == expected.size());
+    auto it = expected.begin();
+    for (const Posting& posting : actual) {
+        assert(posting.document_id == it->first);
+        assert(posting.occurrences == it->second);
+        ++it;
+    }
+}
+
+// 1. Postings stay sorted and complete while blocks are split by insertions in the middle
+// and emptied by erasing, and the blocks can be restored from their raw representation
+void TestCompressedPostingsAddAndErase() {
+    mt19937 generator(1);
+    CompressedPostings postings;
+    map<int, int> expected;
+    
+    // Ascending ids are appended, every other id is left for insertions in the middle
+    for (int document_id = 0; document_id < 4000; document_id += 2) {
+        postings.Add({document_id, document_id % 7 + 1});
+        expected[document_id] = document_id % 7 + 1;
+    }
+    for (int document_id = 1; document_id < 4000; document_id += 4) {
+        postings.Add({document_id, 100000});
+        expected[document_id] = 100000;
+    }
+    AssertSamePostings(postings, expected);
+    assert(any_of(postings.GetBlocks().begin(), postings.GetBlocks().end(), [](const CompressedPostings::Block& block) {
+        return block.size > CompressedPostings::BLOCK_SIZE;
+    }));
+    assert(all_of(postings.GetBlocks().begin(), postings.GetBlocks().end(), [](const CompressedPostings::Block& block) {
+        return block.size <= CompressedPostings::MAX_BLOCK_SIZE;
+    }));
+    
+    // Whole blocks are emptied at the beginning, in the middle and at the end
+    for (int document_id = 0; document_id < 4000; ++document_id) {
+        if (document_id < 600 || (document_id >= 1800 && document_id < 2200) || document_id >= 3500) {
+            assert(postings.Erase(document_id) == (expected.erase(document_id) > 0));
+        }
+    }
+    AssertSamePostings(postings, expected);
+    assert(!postings.Erase(0));
+    assert(!postings.Erase(4001));
+    
+    // Appending continues right after the last posting once the tail was erased
+    postings.Add({5000, 3});
+    expected[5000] = 3;
+    AssertSamePostings(postings, expected);
+    
+    for (int step = 0; step < 20000; ++step) {
+        const int document_id = static_cast<int>(generator() % 6000);
+        if (generator() % 2 == 0) {
+            if (expected.count(document_id) == 0) {
+                const int occurrences = static_cast<int>(generator() % 300 + 1);
+                postings.Add({document_id, occurrences});
+                expected[document_id] = occurrences;
+            }
+        } else {
+            assert(postings.Erase(document_id) == (expected.erase(document_id) > 0));
+        }
+    }
+    AssertSamePostings(postings, expected);
+    for (int document_id = -1; document_id < 6001; ++document_id) {
+        const auto it = expected.find(document_id);
+        assert(postings.GetOccurrences(document_id) == (it == expected.end() ? 0 : it->second));
+    }
+    
+    CompressedPostings::Cursor cursor(postings);
+    for (int document_id = 0; document_id < 6000; document_id += 37) {
+        cursor.SkipTo(document_id);
+        const auto it = expected.lower_bound(document_id);
+        assert(cursor.IsEnd() == (it == expected.end()));
+        if (!cursor.IsEnd()) {
+            assert(cursor.Get().document_id == it->first);
+        }
+    }
+    
+    CompressedPostings restored;
+    assert(restored.Assign(postings.GetBlocks().data(), postings.GetBlocks().size(),
+                           postings.GetBytes().data(), postings.GetBytes().size()));
+    AssertSamePostings(restored, expected);
+    
+    for (const auto& [document_id, _] : map<int, int>(expected)) {
+        assert(postings.Erase(document_id));
+    }
+    assert(postings.empty());
+    assert(postings.GetBlocks().empty());
+    postings.Add({7, 1});
+    assert(GetPostings(postings).size() == 1);
+}
+
+string MakeText(mt19937& generator, int vocabulary_size, int max_word_count) {
+    string text;
+    const int word_count = static_cast<int>(generator() % max_word_count) + 1;
+    for (int i = 0; i < word_count; ++i) {
+        // Squaring the uniform value makes low word numbers much more frequent
+        const double value = uniform_real_distribution<double>(0.0, 1.0)(generator);
+        text += "w"s + to_string(static_cast<int>(vocabulary_size * value * value)) + " "s;
+    }
+    return text;
+}
+
+// Relevance summed in a different order may differ in the last bits
+bool IsSameDocuments(const vector<Document>& lhs, const vector<Document>& rhs) {
+    return equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](const Document& lhs, const Document& rhs) {
+        return lhs.id == rhs.id && abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON && lhs.rating == rhs.rating;
+    });
+}
+
+// Fills the server with documents, then removes and adds documents again so that posting
+// lists have gaps and some ordinals are free. Returns the ids of the documents left.
+set<int> AddDocumentsWithRemovals(SearchServer& search_server, mt19937& generator) {
+    set<int> document_ids;
+    for (int document_id = 0; document_id < 3000; ++document_id) {
+        search_server.AddDocument(document_id, MakeText(generator, 400, 30), static_cast<DocumentStatus>(document_id % 3),
+                                  {static_cast<int>(generator() % 20) - 5});
+        document_ids.insert(document_id);
+    }
+    for (int step = 0; step < 4000; ++step) {
+        const int document_id = static_cast<int>(generator() % 3500);
+        if (document_ids.count(document_id) > 0) {
+            search_server.RemoveDocument(document_id);
+            document_ids.erase(document_id);
+        } else {
+            search_server.AddDocument(document_id, MakeText(generator, 400, 30), DocumentStatus::ACTUAL, {1, 2});
+            document_ids.insert(document_id);
+        }
+    }
+    return document_ids;
+}
+
+// 2. WAND returns exactly the documents of the exhaustive scoring, including relevance
+void TestWandMatchesExhaustive() {
+    mt19937 generator(2);
+    SearchServer search_server("w0 w1"s);
+    AddDocumentsWithRemovals(search_server, generator);
+    // Cached results of the exhaustive queries would be returned in WAND mode as well
+    search_server.SetQueryCacheCapacity(0);
+    
+    for (const int max_result_document_count : {1, 5, 50}) {
+        search_server.SetMaxResultDocumentCount(max_result_document_count);
+        for (int i = 0; i < 300; ++i) {
+            string query = MakeText(generator, 400, 6);
+            if (i % 3 == 0) {
+                query += "-"s + MakeText(generator, 400, 1);
+            }
+            
+            search_server.SetScoringMode(ScoringMode::EXHAUSTIVE);
+            const auto exhaustive_documents = search_server.FindTopDocuments(query);
+            const auto exhaustive_banned_documents = search_server.FindTopDocuments(query, DocumentStatus::BANNED);
+            const auto exhaustive_rated_documents = search_server.FindTopDocuments(query, RatingRange{0, 10});
+            const auto exhaustive_odd_documents = search_server.FindTopDocuments(query, [](int document_id, DocumentStatus, int) {
+                return document_id % 2 == 1;
+            });
+            
+            search_server.SetScoringMode(ScoringMode::WAND);
+            assert(IsSameDocuments(search_server.FindTopDocuments(query), exhaustive_documents));
+            assert(IsSameDocuments(search_server.FindTopDocuments(query, DocumentStatus::BANNED), exhaustive_banned_documents));
+            assert(IsSameDocuments(search_server.FindTopDocuments(query, RatingRange{0, 10}), exhaustive_rated_documents));
+            assert(IsSameDocuments(search_server.FindTopDocuments(query, [](int document_id, DocumentStatus, int) {
+                return document_id % 2 == 1;
+            }), exhaustive_odd_documents));
+        }
+    }
+    assert(search_server.GetQueryCacheStats().hits == 0);
+}
+
+string GetTemporaryIndexPath(const string& name) {
+    return (filesystem::temp_directory_path() / name).string();
+}
+
+void AssertSameServers(const SearchServer& lhs, const SearchServer& rhs, mt19937& generator) {
+    assert(lhs.GetDocumentCount() == rhs.GetDocumentCount());
+    assert(equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end()));
+    for (int i = 0; i < 100; ++i) {
+        const string query = MakeText(generator, 400, 5) + "-"s + MakeText(generator, 400, 1);
+        assert(IsSameDocuments(lhs.FindTopDocuments(query), rhs.FindTopDocuments(query)));
+        assert(IsSameDocuments(lhs.FindTopDocuments(execution::par, query, DocumentStatus::IRRELEVANT),
+                               rhs.FindTopDocuments(execution::par, query, DocumentStatus::IRRELEVANT)));
+    }
+    for (const int document_id : lhs) {
+        assert(lhs.GetWordFrequencies(document_id) == rhs.GetWordFrequencies(document_id));
+        const string query = MakeText(generator, 400, 8);
+        assert(lhs.MatchDocument(query, document_id) == rhs.MatchDocument(query, document_id));
+    }
+}
+
+// 3. An opened index answers like the saved server, can be changed and saved over its own file,
+// and a damaged file is rejected
+void TestSaveAndOpenIndex() {
+    mt19937 generator(3);
+    const string path = GetTemporaryIndexPath("search_server_and_paginator_tests.index"s);
+    SearchServer search_server("w0 w1"s);
+    const set<int> document_ids = AddDocumentsWithRemovals(search_server, generator);
+    search_server.SaveIndex(path);
+    
+    {
+        SearchServer opened_server = SearchServer::OpenIndex(path);
+        AssertSameServers(search_server, opened_server, generator);
+    }
+    {
+        // Changes after opening, then the index is saved over the file it is mapped from
+        SearchServer opened_server = SearchServer::OpenIndex(path);
+        SearchServer changed_server = SearchServer::OpenIndex(path);
+        int position = 0;
+        for (const int document_id : document_ids) {
+            if (position++ % 5 == 0) {
+                opened_server.RemoveDocument(document_id);
+                changed_server.RemoveDocument(document_id);
+            }
+        }
+        opened_server.AddDocument(10000, "w5 w6 w7"s, DocumentStatus::ACTUAL, {4});
+        changed_server.AddDocument(10000, "w5 w6 w7"s, DocumentStatus::ACTUAL, {4});
+        opened_server.SaveIndex(path);
+        AssertSameServers(changed_server, SearchServer::OpenIndex(path), generator);
+    }
+    
+    string content;
+    {
+        ifstream in(path, ios::binary);
+        content.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    const auto assert_rejected = [&path](const string& damaged_content) {
+        {
+            ofstream out(path, ios::binary | ios::trunc);
+            out.write(damaged_content.data(), damaged_content.size());
+        }
+        try {
+            SearchServer::OpenIndex(path);
+            assert(false);
+        } catch (const runtime_error&) {
+        }
+    };
+    assert_rejected(""s);
+    assert_rejected(content.substr(0, content.size() / 2));
+    string wrong_magic = content;
+    wrong_magic[0] = 'X';
+    assert_rejected(wrong_magic);
+    string wrong_term_count = content;
+    const uint64_t huge_count = numeric_limits<uint64_t>::max() / 2;
+    copy_n(reinterpret_cast<const char*>(&huge_count), sizeof(huge_count),
+           wrong_term_count.begin() + offsetof(IndexFileHeader, term_count));
+    assert_rejected(wrong_term_count);
+    
+    // Damaged documents and postings, the second document has no words but a valid word count of zero
+    SearchServer small_server("in"s);
+    small_server.AddDocument(1, "cat in the city cat"s, DocumentStatus::ACTUAL, {1});
+    small_server.AddDocument(2, "in"s, DocumentStatus::BANNED, {2});
+    small_server.SaveIndex(path);
+    AssertSameServers(small_server, SearchServer::OpenIndex(path), generator);
+    {
+        ifstream in(path, ios::binary);
+        content.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    IndexFileHeader header;
+    copy_n(content.data(), sizeof(header), reinterpret_cast<char*>(&header));
+    const IndexFileLayout layout(header);
+    IndexFileTerm first_term;
+    copy_n(content.data() + layout.terms_offset, sizeof(first_term), reinterpret_cast<char*>(&first_term));
+    const auto assert_rejected_field = [&content, &assert_rejected](uint64_t offset, int32_t value) {
+        string damaged_content = content;
+        copy_n(reinterpret_cast<const char*>(&value), sizeof(value), damaged_content.begin() + offset);
+        assert_rejected(damaged_content);
+    };
+    const uint64_t first_document_offset = layout.documents_offset;
+    assert_rejected_field(first_document_offset + offsetof(IndexFileDocument, status), -1);
+    assert_rejected_field(first_document_offset + offsetof(IndexFileDocument, status), 4);
+    assert_rejected_field(first_document_offset + offsetof(IndexFileDocument, word_count), -1);
+    // Every word of the first document occurs in it, "cat" twice
+    assert_rejected_field(first_document_offset + offsetof(IndexFileDocument, word_count), 0);
+    assert_rejected_field(first_document_offset + offsetof(IndexFileDocument, word_count), 1);
+    // The first byte of a posting list holds the occurrences of its first posting
+    for (const uint8_t occurrences : {0, 5, 127}) {
+        string damaged_content = content;
+        damaged_content[layout.posting_bytes_offset + first_term.first_byte] = static_cast<char>(occurrences);
+        assert_rejected(damaged_content);
+    }
+    remove(path.c_str());
+    
+    try {
+        SearchServer::OpenIndex(path);
+        assert(false);
+    } catch (const runtime_error&) {
+    }
+}
+
+// Type and message of the exception the error holds, empty for no error
+string DescribeError(const exception_ptr& error) {
+    if (!error) {
+        return {};
+    }
+    try {
+        rethrow_exception(error);
+    } catch (const exception& e) {
+        return typeid(e).name() + ": "s + e.what();
+    }
+}
+
+// 4. A batch reports, document by document, the same errors as adding the documents one by one
+void TestAddDocumentsErrorsMatchAddDocument() {
+    const vector<RawDocument> documents = {
+            {1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {7, 2, 7}},
+            {2, "funny pet with curly hair"s, DocumentStatus::BANNED, {1, 2}},
+            {1, "same id in the batch"s, DocumentStatus::ACTUAL, {1}},
+            {3, "already added id"s, DocumentStatus::ACTUAL, {1}},
+            {-4, "negative id"s, DocumentStatus::ACTUAL, {1}},
+            {5, "control \x12 character"s, DocumentStatus::ACTUAL, {1}},
+            {6, "big cat nasty hair"s, DocumentStatus::ACTUAL, {}},
+            {7, ""s, DocumentStatus::IRRELEVANT, {3}},
+            {6, "same id after a valid document"s, DocumentStatus::ACTUAL, {1}},
+    };
+    
+    for (const bool is_parallel : {false, true}) {
+        SearchServer one_by_one_server("and with"s);
+        SearchServer batch_server("and with"s);
+        one_by_one_server.AddDocument(3, "first document"s, DocumentStatus::ACTUAL, {1});
+        batch_server.AddDocument(3, "first document"s, DocumentStatus::ACTUAL, {1});
+        
+        vector<string> expected_errors;
+        for (const RawDocument& document : documents) {
+            try {
+                one_by_one_server.AddDocument(document.id, document.text, document.status, document.ratings);
+                expected_errors.push_back({});
+            } catch (...) {
+                expected_errors.push_back(DescribeError(current_exception()));
+            }
+        }
+        
+        const vector<exception_ptr> errors = is_parallel ? batch_server.AddDocuments(execution::par, documents)
+                                                         : batch_server.AddDocuments(execution::seq, documents);
+        assert(errors.size() == documents.size());
+        for (size_t i = 0; i < documents.size(); ++i) {
+            assert(DescribeError(errors[i]) == expected_errors[i]);
+        }
+        for (const size_t i : {2, 3, 4, 5, 8}) {
+            assert(!expected_errors[i].empty());
+        }
+        
+        assert(equal(one_by_one_server.begin(), one_by_one_server.end(), batch_server.begin(), batch_server.end()));
+        for (const string& query : {"funny pet"s, "nasty -rat"s, "hair cat"s, "first"s}) {
+            assert(IsSameDocuments(one_by_one_server.FindTopDocuments(query), batch_server.FindTopDocuments(query)));
+        }
+    }
+}
+
+// 5. Batch queries return the same documents as the queries run one by one, joined in input order
+void TestProcessQueries() {
+    mt19937 generator(5);
+    SearchServer search_server("w0 w1"s);
+    AddDocumentsWithRemovals(search_server, generator);
+    vector<string> queries;
+    for (int i = 0; i < 200; ++i) {
+        queries.push_back(MakeText(generator, 400, 4));
+        if (i % 4 == 0) {
+            queries.back() += "-"s + MakeText(generator, 400, 1);
+        }
+    }
+    queries.push_back("unknown"s);
+    
+    // The largest limits leave room for only a few queries at a time in the joined buffer
+    for (const int max_result_document_count : {0, 1, 5, 4000, 100000}) {
+        search_server.SetMaxResultDocumentCount(max_result_document_count);
+        const vector<vector<Document>> documents_lists = ProcessQueries(search_server, queries);
+        assert(documents_lists.size() == queries.size());
+        vector<Document> joined_documents;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const vector<Document> documents = search_server.FindTopDocuments(queries[i]);
+            assert(IsSameDocuments(documents_lists[i], documents));
+            joined_documents.insert(joined_documents.end(), documents.begin(), documents.end());
+        }
+        assert(IsSameDocuments(ProcessQueriesJoined(search_server, queries), joined_documents));
+    }
+    assert(ProcessQueries(search_server, {}).empty());
+    assert(ProcessQueriesJoined(search_server, {}).empty());
+}
+
+// Words of text found byte by byte, each with the flag of having no control characters
+vector<pair<string_view, bool>> SplitWordsByteByByte(string_view text) {
+    vector<pair<string_view, bool>> words;
+    size_t word_begin = 0;
+    for (size_t pos = 0; pos <= text.size(); ++pos) {
+        if (pos < text.size() && text[pos] != ' ') {
+            continue;
+        }
+        if (pos > word_begin) {
+            const string_view word = text.substr(word_begin, pos - word_begin);
+            words.push_back({word, none_of(word.begin(), word.end(), IsControlChar)});
+        }
+        word_begin = pos + 1;
+    }
+    return words;
+}
+
+void AssertSameWords(string_view text) {
+    vector<pair<string_view, bool>> words;
+    ForEachWord(text, [&words](string_view word, bool is_valid) {
+        words.push_back({word, is_valid});
+    });
+    const vector<pair<string_view, bool>> expected_words = SplitWordsByteByByte(text);
+    assert(words == expected_words);
+    for (size_t i = 0; i < words.size(); ++i) {
+        assert(words[i].first.data() == expected_words[i].first.data());
+    }
+    const vector<string_view> split_words = SplitIntoWords(text);
+    assert(split_words.size() == expected_words.size());
+}
+
+// 6. Words and control characters are found the same way whether they lie inside a SIMD chunk,
+// cross the boundary between chunks or are left for the byte-by-byte tail
+void TestForEachWordMatchesByteByByteScan() {
+    AssertSameWords(""s);
+    AssertSameWords(string(64, ' '));
+    AssertSameWords(string(100, 'a'));
+    // Every word length and position, so words start and end on both sides of 16 and 32 byte boundaries
+    for (size_t offset = 0; offset < 40; ++offset) {
+        for (size_t length = 1; length < 70; ++length) {
+            string text = string(offset, ' ') + string(length, 'w') + " tail"s;
+            AssertSameWords(text);
+            // Control characters at the first and the last byte of the word and right after it
+            for (const size_t control_pos : {offset, offset + length - 1, offset + length}) {
+                string damaged_text = text;
+                damaged_text[control_pos] = '\x1F';
+                AssertSameWords(damaged_text);
+            }
+        }
+    }
+    
+    // Bytes from 0x80 are not control characters even though char is signed
+    mt19937 generator(6);
+    const string alphabet = "ab  \x01\x1F\x7F\x80\xFF!~"s;
+    for (int i = 0; i < 20000; ++i) {
+        string text(generator() % 150, ' ');
+        const size_t space_rate = generator() % 8 + 2;
+        for (char& c : text) {
+            c = generator() % space_rate == 0 ? ' ' : alphabet[generator() % alphabet.size()];
+        }
+        AssertSameWords(text);
+    }
+    
+    SearchServer search_server(""s);
+    const string long_word = string(40, 'x') + '\x02' + string(10, 'x');
+    try {
+        search_server.AddDocument(1, "first words "s + long_word, DocumentStatus::ACTUAL, {1});
+        assert(false);
+    } catch (const invalid_argument&) {
+    }
+    try {
+        search_server.FindTopDocuments("some query words "s + long_word);
+        assert(false);
+    } catch (const invalid_argument&) {
+    }
+    search_server.AddDocument(1, "first words "s + string(40, 'x') + "\x80\xFF"s, DocumentStatus::ACTUAL, {1});
+    assert(search_server.FindTopDocuments(string(40, 'x') + "\x80\xFF"s).size() == 1);
+}
+
+// 7. A removed document is gone from searches, word frequencies, iteration and the IDF of its words,
+// and the server answers as if it had never been added
+void TestRemoveDocument() {
+    SearchServer search_server("and"s);
+    search_server.AddDocument(1, "white cat and fancy collar"s, DocumentStatus::ACTUAL, {8, -3});
+    search_server.AddDocument(2, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(3, "groomed dog expressive eyes"s, DocumentStatus::BANNED, {5, -12, 2, 1});
+    
+    const map<string_view, double> expected_word_freqs = {{"cat"sv, 0.25}, {"fluffy"sv, 0.5}, {"tail"sv, 0.25}};
+    const auto& word_freqs = search_server.GetWordFrequencies(2);
+    assert(equal(word_freqs.begin(), word_freqs.end(), expected_word_freqs.begin(), expected_word_freqs.end()));
+    assert(search_server.GetWordFrequencies(4).empty());
+    
+    search_server.RemoveDocument(2);
+    assert(search_server.GetDocumentCount() == 2);
+    assert(search_server.GetWordFrequencies(2).empty());
+    assert((vector<int>(search_server.begin(), search_server.end()) == vector<int>{1, 3}));
+    assert(search_server.FindTopDocuments("fluffy tail"s).empty());
+    // "cat" is now in one document of two
+    const auto documents = search_server.FindTopDocuments("cat"s);
+    assert(documents.size() == 1 && documents[0].id == 1);
+    assert(abs(documents[0].relevance - 0.25 * log(2.0)) < RELEVANCE_EPSILON);
+    try {
+        search_server.MatchDocument("cat"s, 2);
+        assert(false);
+    } catch (const out_of_range&) {
+    }
+    
+    // Unknown and already removed ids are ignored
+    search_server.RemoveDocument(2);
+    search_server.RemoveDocument(-1);
+    search_server.RemoveDocument(execution::par, 100);
+    assert(search_server.GetDocumentCount() == 2);
+    
+    search_server.AddDocument(2, "dog without tail"s, DocumentStatus::ACTUAL, {1});
+    assert(search_server.FindTopDocuments("tail"s).size() == 1);
+    search_server.RemoveDocument(execution::par, 3);
+    assert(search_server.FindTopDocuments("groomed dog"s, DocumentStatus::BANNED).empty());
+    
+    // Removals in any order give the same server as adding only the remaining documents
+    mt19937 generator(7);
+    for (const bool is_parallel : {false, true}) {
+        vector<string> texts;
+        SearchServer changed_server("w0"s);
+        for (int document_id = 0; document_id < 2000; ++document_id) {
+            texts.push_back(MakeText(generator, 300, 20));
+            changed_server.AddDocument(document_id, texts.back(), DocumentStatus::ACTUAL, {document_id % 10});
+        }
+        vector<int> removed_ids(2000);
+        iota(removed_ids.begin(), removed_ids.end(), 0);
+        shuffle(removed_ids.begin(), removed_ids.end(), generator);
+        removed_ids.resize(1500);
+        for (const int document_id : removed_ids) {
+            if (is_parallel) {
+                changed_server.RemoveDocument(execution::par, document_id);
+            } else {
+                changed_server.RemoveDocument(document_id);
+            }
+        }
+        
+        SearchServer expected_server("w0"s);
+        const set<int> removed_id_set(removed_ids.begin(), removed_ids.end());
+        for (int document_id = 0; document_id < 2000; ++document_id) {
+            if (removed_id_set.count(document_id) == 0) {
+                expected_server.AddDocument(document_id, texts[document_id], DocumentStatus::ACTUAL, {document_id % 10});
+            }
+        }
+        AssertSameServers(expected_server, changed_server, generator);
+    }
+}
+
+// 8. Documents with the same set of words as a document with a lower id are removed,
+// regardless of word order, repeated words and stop words
+void TestRemoveDuplicates() {
+    SearchServer search_server("and with"s);
+    search_server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(3, "funny pet with curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(4, "funny pet and curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(5, "funny funny pet and nasty nasty rat"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(6, "funny pet and not very nasty rat"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(7, "very nasty rat and not very funny pet"s, DocumentStatus::BANNED, {1, 2});
+    search_server.AddDocument(8, "pet with rat and rat and rat"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(9, "nasty rat with curly hair"s, DocumentStatus::ACTUAL, {1, 2});
+    search_server.AddDocument(10, ""s, DocumentStatus::ACTUAL, {});
+    search_server.AddDocument(11, "and with"s, DocumentStatus::ACTUAL, {});
+    // A subset of the words of another document is not a duplicate
+    search_server.AddDocument(12, "funny pet"s, DocumentStatus::ACTUAL, {});
+    
+    assert((RemoveDuplicates(search_server) == vector<int>{3, 4, 5, 7, 11}));
+    assert((vector<int>(search_server.begin(), search_server.end()) == vector<int>{1, 2, 6, 8, 9, 10, 12}));
+    assert(search_server.FindTopDocuments("curly"s).size() == 2);
+    assert(RemoveDuplicates(search_server).empty());
+    assert(search_server.GetDocumentCount() == 7);
+    
+    // Many documents with few distinct word sets, so fingerprints are shared by many ids
+    mt19937 generator(8);
+    SearchServer random_server(""s);
+    map<set<string>, int> word_set_to_first_id;
+    vector<int> expected_duplicate_ids;
+    for (int document_id = 0; document_id < 1000; ++document_id) {
+        const string text = MakeText(generator, 6, 4);
+        random_server.AddDocument(document_id, text, DocumentStatus::ACTUAL, {1});
+        const vector<string_view> words = SplitIntoWords(text);
+        if (!word_set_to_first_id.emplace(set<string>(words.begin(), words.end()), document_id).second) {
+            expected_duplicate_ids.push_back(document_id);
+        }
+    }
+    assert(RemoveDuplicates(random_server) == expected_duplicate_ids);
+    assert(random_server.GetDocumentCount() == static_cast<int>(word_set_to_first_id.size()));
+}
+
+// 9. Equal parsed queries share a cache entry, and every change of the index or of the result limit
+// drops the cached results
+void TestQueryCache() {
+    SearchServer search_server("and"s);
+    search_server.AddDocument(1, "white cat and fancy collar"s, DocumentStatus::ACTUAL, {8, -3});
+    search_server.AddDocument(2, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(3, "groomed dog expressive eyes"s, DocumentStatus::BANNED, {5, -12, 2, 1});
+    
+    QueryCacheStats expected_stats;
+    const auto assert_stats = [&search_server, &expected_stats](uint64_t hits, uint64_t misses) {
+        expected_stats.hits += hits;
+        expected_stats.misses += misses;
+        const QueryCacheStats stats = search_server.GetQueryCacheStats();
+        assert(stats.hits == expected_stats.hits && stats.misses == expected_stats.misses);
+    };
+    assert_stats(0, 0);
+    
+    const auto cat_documents = search_server.FindTopDocuments("cat"s);
+    assert_stats(0, 1);
+    // Repeated words, word order and stop words do not change the parsed query
+    assert(IsSameDocuments(search_server.FindTopDocuments("cat cat and"s), cat_documents));
+    assert(IsSameDocuments(search_server.FindTopDocuments(execution::par, "cat"s), cat_documents));
+    assert_stats(2, 0);
+    search_server.FindTopDocuments("cat -dog"s);
+    search_server.FindTopDocuments("dog cat"s);
+    assert_stats(0, 2);
+    search_server.FindTopDocuments("-dog cat"s);
+    search_server.FindTopDocuments("cat dog"s);
+    assert_stats(2, 0);
+    
+    // Every kind of filter gets its own entries
+    assert(search_server.FindTopDocuments("dog"s, DocumentStatus::BANNED).size() == 1);
+    search_server.FindTopDocuments("dog"s, RatingRange{0, 10});
+    search_server.FindTopDocuments("dog"s, [](int, DocumentStatus, int rating) {
+        return rating > 0;
+    });
+    assert_stats(0, 3);
+    search_server.FindTopDocuments("dog"s, DocumentStatus::BANNED);
+    search_server.FindTopDocuments("dog"s, RatingRange{0, 10});
+    assert_stats(2, 0);
+    search_server.FindTopDocuments("dog"s, RatingRange{0, 11});
+    assert_stats(0, 1);
+    // Predicates with state are not cached at all
+    const int min_rating = 0;
+    search_server.FindTopDocuments("dog"s, [min_rating](int, DocumentStatus, int rating) {
+        return rating > min_rating;
+    });
+    search_server.FindTopDocuments("dog"s, DocumentIdSet{3});
+    assert_stats(0, 0);
+    
+    search_server.AddDocument(4, "black cat"s, DocumentStatus::ACTUAL, {1});
+    assert(search_server.FindTopDocuments("cat"s).size() == 3);
+    assert_stats(0, 1);
+    search_server.RemoveDocument(4);
+    assert(IsSameDocuments(search_server.FindTopDocuments("cat"s), cat_documents));
+    assert_stats(0, 1);
+    search_server.SetMaxResultDocumentCount(1);
+    assert(search_server.FindTopDocuments("cat"s).size() == 1);
+    assert_stats(0, 1);
+    search_server.FindTopDocuments("cat"s);
+    assert_stats(1, 0);
+    
+    // The least recently used entry is evicted
+    search_server.SetQueryCacheCapacity(2);
+    search_server.FindTopDocuments("collar"s);
+    search_server.FindTopDocuments("tail"s);
+    search_server.FindTopDocuments("collar"s);
+    search_server.FindTopDocuments("eyes"s);
+    assert_stats(1, 3);
+    search_server.FindTopDocuments("collar"s);
+    search_server.FindTopDocuments("tail"s);
+    assert_stats(1, 1);
+    
+    search_server.SetQueryCacheCapacity(0);
+    search_server.FindTopDocuments("collar"s);
+    search_server.FindTopDocuments("collar"s);
+    assert_stats(0, 2);
+}
+
+// 10. Only the last 1440 requests are counted, however many times the window wraps around
+void TestRequestQueue() {
+    SearchServer search_server("and in at"s);
+    search_server.AddDocument(1, "curly cat curly tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(2, "curly dog and fancy collar"s, DocumentStatus::ACTUAL, {1, 2, 3});
+    search_server.AddDocument(3, "big cat fancy collar "s, DocumentStatus::ACTUAL, {1, 2, 8});
+    search_server.AddDocument(4, "big dog sparrow Eugene"s, DocumentStatus::ACTUAL, {1, 3, 2});
+    search_server.AddDocument(5, "big dog sparrow Vasiliy"s, DocumentStatus::BANNED, {1, 1, 1});
+    
+    RequestQueue request_queue(search_server);
+    for (int i = 0; i < 1439; ++i) {
+        request_queue.AddFindRequest("empty request"s);
+    }
+    assert(request_queue.GetNoResultRequests() == 1439);
+    // The window gets full with a request that has results
+    request_queue.AddFindRequest("curly dog"s);
+    assert(request_queue.GetNoResultRequests() == 1439);
+    // The first requests leave the window
+    request_queue.AddFindRequest("big collar"s);
+    assert(request_queue.GetNoResultRequests() == 1438);
+    request_queue.AddFindRequest("sparrow"s);
+    assert(request_queue.GetNoResultRequests() == 1437);
+    
+    // Requests with a status or a predicate are counted by their own results
+    mt19937 generator(10);
+    deque<bool> last_requests(1437, true);
+    last_requests.resize(1440, false);
+    for (int i = 0; i < 5000; ++i) {
+        vector<Document> documents;
+        switch (generator() % 4) {
+            case 0:
+                documents = request_queue.AddFindRequest(generator() % 2 == 0 ? "cat"s : "empty"s);
+                break;
+            case 1:
+                documents = request_queue.AddFindRequest("sparrow"s, DocumentStatus::BANNED);
+                break;
+            case 2:
+                documents = request_queue.AddFindRequest("sparrow"s, DocumentStatus::IRRELEVANT);
+                break;
+            default:
+                documents = request_queue.AddFindRequest("big"s, [](int document_id, DocumentStatus, int) {
+                    return document_id == 1;
+                });
+        }
+        last_requests.push_back(documents.empty());
+        last_requests.pop_front();
+        assert(request_queue.GetNoResultRequests() == count(last_requests.begin(), last_requests.end(), true));
+    }
+}
+
+void AssertSameIds(const DocumentIdBitmap& bitmap, const set<int>& expected_ids, int max_id) {
+    assert(bitmap.empty() == expected_ids.empty());
+    for (int document_id = 0; document_id <= max_id; ++document_id) {
+        assert(bitmap.Contains(document_id) == (expected_ids.count(document_id) > 0));
+    }
+}
+
+// 11. The bitmap holds the same ids before and after a group of ids switches from a sorted array
+// to a bitmap, whether ids are added in ascending order or not
+void TestDocumentIdBitmap() {
+    DocumentIdBitmap bitmap;
+    set<int> expected_ids;
+    AssertSameIds(bitmap, expected_ids, 1000);
+    
+    // Ascending ids in the first group, more than an array holds
+    for (int document_id = 0; document_id < 30000; document_id += 5) {
+        bitmap.Add(document_id);
+        expected_ids.insert(document_id);
+        if (document_id % 4000 == 0) {
+            AssertSameIds(bitmap, expected_ids, 70000);
+        }
+    }
+    AssertSameIds(bitmap, expected_ids, 70000);
+    
+    // Random ids in several groups, including repeated ids and groups that are created out of order
+    mt19937 generator(11);
+    for (int i = 0; i < 20000; ++i) {
+        const int document_id = static_cast<int>(generator() % (1 << 19));
+        const int group_size = i < 10000 ? 1 << 19 : 1 << 17;
+        bitmap.Add(document_id % group_size);
+        expected_ids.insert(document_id % group_size);
+    }
+    AssertSameIds(bitmap, expected_ids, 1 << 19);
+    
+    DocumentIdBitmap largest_ids;
+    largest_ids.Add(numeric_limits<int>::max());
+    largest_ids.Add(numeric_limits<int>::max() - 65536);
+    assert(largest_ids.Contains(numeric_limits<int>::max()));
+    assert(largest_ids.Contains(numeric_limits<int>::max() - 65536));
+    assert(!largest_ids.Contains(numeric_limits<int>::max() - 1));
+    assert(!largest_ids.Contains(0));
+    
+    // A minus word of most documents excludes them on every scoring path
+    SearchServer search_server(""s);
+    for (int document_id = 0; document_id < 12000; ++document_id) {
+        search_server.AddDocument(document_id, document_id % 3 == 0 ? "cat"s : "cat dog"s, DocumentStatus::ACTUAL, {1});
+    }
+    search_server.SetMaxResultDocumentCount(12000);
+    search_server.SetQueryCacheCapacity(0);
+    for (const ScoringMode scoring_mode : {ScoringMode::EXHAUSTIVE, ScoringMode::WAND}) {
+        search_server.SetScoringMode(scoring_mode);
+        for (const auto& documents : {search_server.FindTopDocuments("cat -dog"s),
+                                      search_server.FindTopDocuments(execution::par, "cat -dog"s)}) {
+            assert(documents.size() == 4000);
+            assert(all_of(documents.begin(), documents.end(), [](const Document& document) {
+                return document.id % 3 == 0;
+            }));
+        }
+    }
+}
+
+// 12. MatchDocument gives the same words and status with every policy, for queries matched
+// sequentially and for those long enough to be matched in parallel
+void TestMatchDocumentPolicies() {
+    mt19937 generator(12);
+    SearchServer search_server("w0 w1"s);
+    for (int document_id = 0; document_id < 300; ++document_id) {
+        search_server.AddDocument(document_id, MakeText(generator, 200, 40), static_cast<DocumentStatus>(document_id % 4),
+                                  {document_id});
+    }
+    
+    for (int i = 0; i < 100; ++i) {
+        // Up to three times as many words as are needed for parallel matching
+        string query = MakeText(generator, 200, static_cast<int>(3 * PARALLEL_MATCH_MIN_WORD_COUNT));
+        if (i % 2 == 0) {
+            query += "-"s + MakeText(generator, 200, 1);
+        }
+        for (int document_id = 0; document_id < 300; document_id += 7) {
+            const auto [words, status] = search_server.MatchDocument(query, document_id);
+            assert(status == static_cast<DocumentStatus>(document_id % 4));
+            assert(is_sorted(words.begin(), words.end()));
+            assert(adjacent_find(words.begin(), words.end()) == words.end());
+            assert(search_server.MatchDocument(execution::seq, query, document_id) == make_tuple(words, status));
+            assert(search_server.MatchDocument(execution::par, query, document_id) == make_tuple(words, status));
+        }
+    }
+    
+    search_server.AddDocument(1000, "cat dog"s, DocumentStatus::BANNED, {1});
+    string long_query;
+    for (size_t i = 0; i < PARALLEL_MATCH_MIN_WORD_COUNT; ++i) {
+        long_query += "x"s + to_string(i) + " "s;
+    }
+    for (const string& query : {"dog cat bird"s, long_query + "dog cat"s}) {
+        const auto expected_match = make_tuple(vector<string_view>{"cat"sv, "dog"sv}, DocumentStatus::BANNED);
+        assert(search_server.MatchDocument(execution::seq, query, 1000) == expected_match);
+        assert(search_server.MatchDocument(execution::par, query, 1000) == expected_match);
+        // A minus word empties the words, the status is still reported
+        const auto excluded_match = make_tuple(vector<string_view>{}, DocumentStatus::BANNED);
+        assert(search_server.MatchDocument(execution::seq, query + " -dog"s, 1000) == excluded_match);
+        assert(search_server.MatchDocument(execution::par, query + " -dog"s, 1000) == excluded_match);
+    }
+    
+    // Matched words point into the index and stay valid after the query is gone
+    vector<string_view> matched_words;
+    {
+        string query = long_query + "dog"s;
+        matched_words = get<0>(search_server.MatchDocument(execution::par, query, 1000));
+        query.assign(query.size(), '#');
+    }
+    assert(matched_words == vector<string_view>{"dog"sv});
+    
+    for (const string& query : {"cat"s, long_query + "cat"s}) {
+        try {
+            search_server.MatchDocument(execution::par, query, 2000);
+            assert(false);
+        } catch (const out_of_range&) {
+        }
+        try {
+            search_server.MatchDocument(execution::seq, query + " --dog"s, 1000);
+            assert(false);
+        } catch (const invalid_argument&) {
+        }
+        try {
+            search_server.MatchDocument(execution::par, query + " -"s, 1000);
+            assert(false);
+        } catch (const invalid_argument&) {
+        }
+    }
+}
+
+// 13. Predicates that the server recognizes by type return the same documents as equivalent lambdas,
+// both when a DocumentIdSet is small enough to look its documents up one by one and when it is not
+void TestSpecializedPredicatesMatchLambdas() {
+    mt19937 generator(13);
+    SearchServer search_server("w0"s);
+    // A small vocabulary makes long posting lists, so that a few ids are cheaper to look up
+    for (int document_id = 0; document_id < 3000; ++document_id) {
+        search_server.AddDocument(document_id, MakeText(generator, 50, 30), static_cast<DocumentStatus>(document_id % 3),
+                                  {static_cast<int>(generator() % 20) - 5});
+    }
+    for (int document_id = 0; document_id < 3000; document_id += 4) {
+        search_server.RemoveDocument(document_id);
+    }
+    search_server.SetMaxResultDocumentCount(50);
+    
+    vector<string> queries = {"w2 w3 w5 -w7"s, "w4"s, "w2 w3 -w999"s, "unknown"s};
+    for (int i = 0; i < 30; ++i) {
+        queries.push_back(MakeText(generator, 50, 5) + "-"s + MakeText(generator, 50, 1));
+    }
+    const auto find_both = [&search_server](const string& query, auto document_predicate) {
+        return make_pair(search_server.FindTopDocuments(query, document_predicate),
+                         search_server.FindTopDocuments(execution::par, query, document_predicate));
+    };
+    const auto assert_same = [](const pair<vector<Document>, vector<Document>>& lhs,
+                                const pair<vector<Document>, vector<Document>>& rhs) {
+        assert(IsSameDocuments(lhs.first, rhs.first));
+        assert(IsSameDocuments(lhs.second, rhs.second));
+        assert(IsSameDocuments(lhs.first, lhs.second));
+    };
+    
+    for (const string& query : queries) {
+        // A few ids take the lookup path, thousands of them the scan over posting lists.
+        // Unknown, removed and repeated ids are ignored.
+        for (const size_t id_count : {0, 1, 3, 20, 300, 3000}) {
+            vector<int> ids = {-5, 100000, 100000};
+            for (size_t i = 0; i < id_count; ++i) {
+                ids.push_back(static_cast<int>(generator() % 3300));
+            }
+            const set<int> id_set(ids.begin(), ids.end());
+            assert_same(find_both(query, DocumentIdSet(ids)), find_both(query, [&id_set](int document_id, DocumentStatus, int) {
+                return id_set.count(document_id) > 0;
+            }));
+        }
+        for (const DocumentStatus status : {DocumentStatus::ACTUAL, DocumentStatus::BANNED, DocumentStatus::REMOVED}) {
+            assert_same(find_both(query, StatusEquals{status}), find_both(query, [status](int, DocumentStatus document_status, int) {
+                return document_status == status;
+            }));
+        }
+        for (const auto& [min_rating, max_rating] : {pair{-5, 14}, pair{0, 0}, pair{3, 7}, pair{10, 2}}) {
+            const RatingRange range{min_rating, max_rating};
+            assert_same(find_both(query, range), find_both(query, [range](int, DocumentStatus, int rating) {
+                return range.min_rating <= rating && rating <= range.max_rating;
+            }));
+        }
+        assert(IsSameDocuments(search_server.FindTopDocuments(query, RatingRange{}),
+                               search_server.FindTopDocuments(query, [](int, DocumentStatus, int) {
+                                   return true;
+                               })));
+    }
+}
+
+// 14. The stop word set finds exactly its own words, including among many colliding hashes,
+// and the server leaves stop words out of documents and queries
+void TestStopWordSet() {
+    const StopWordSet empty_set(set<string, less<>>{});
+    assert(empty_set.size() == 0);
+    assert(empty_set.begin() == empty_set.end());
+    assert(!empty_set.Contains(""sv));
+    assert(!empty_set.Contains("a"sv));
+    
+    set<string, less<>> words = {"a"s, "an"s, "and"s, "in"s, "the"s};
+    for (int i = 0; i < 1000; ++i) {
+        words.insert("s"s + to_string(i));
+    }
+    const StopWordSet stop_words(words);
+    assert(stop_words.size() == words.size());
+    assert(equal(stop_words.begin(), stop_words.end(), words.begin(), words.end()));
+    for (const string& word : words) {
+        assert(stop_words.Contains(word));
+    }
+    for (const string_view word : {""sv, "A"sv, "ann"sv, "th"sv, "the "sv, "s1000"sv, "s01"sv, "s-1"sv}) {
+        assert(!stop_words.Contains(word));
+    }
+    for (int i = 1000; i < 100000; ++i) {
+        assert(!stop_words.Contains("s"s + to_string(i)));
+    }
+    
+    // Repeated and surrounding spaces in the stop words text are ignored
+    SearchServer search_server("  in the  in "s);
+    search_server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, {1});
+    assert(search_server.FindTopDocuments("in the"s).empty());
+    const auto& word_freqs = search_server.GetWordFrequencies(1);
+    assert(word_freqs.size() == 2 && word_freqs.at("cat"sv) == 0.5 && word_freqs.at("city"sv) == 0.5);
+    assert(get<0>(search_server.MatchDocument("the cat -in"s, 1)) == vector<string_view>{"cat"sv});
+    
+    const vector<string> stop_word_container = {"in"s, ""s, "the"s, "in"s};
+    assert(SearchServer(stop_word_container).FindTopDocuments("in the"s).empty());
+    try {
+        SearchServer invalid_server("in \x12the"s);
+        assert(false);
+    } catch (const invalid_argument&) {
+    }
+}
+
+// 15. Histogram buckets, the text and JSON forms of a snapshot, and the counts collected by the server
+// when it is built with SEARCH_SERVER_STATS
+void TestQueryStats() {
+    assert(HistogramSnapshot::GetBucket(0) == 0);
+    assert(HistogramSnapshot::GetBucket(1) == 1);
+    assert(HistogramSnapshot::GetBucket(3) == 2);
+    assert(HistogramSnapshot::GetBucket(4) == 3);
+    assert(HistogramSnapshot::GetBucket(numeric_limits<uint64_t>::max()) == 64);
+    for (size_t bucket = 0; bucket < HistogramSnapshot::BUCKET_COUNT; ++bucket) {
+        const uint64_t upper_bound = HistogramSnapshot::GetBucketUpperBound(bucket);
+        assert(HistogramSnapshot::GetBucket(upper_bound) == bucket);
+        if (bucket < 64) {
+            assert(HistogramSnapshot::GetBucket(upper_bound + 1) == bucket + 1);
+        }
+    }
+    
+    QueryStatsSnapshot snapshot;
+    snapshot.stage_nanoseconds[static_cast<size_t>(QueryStage::SCORING)] = {1, 0, {}};
+    snapshot.stage_nanoseconds[static_cast<size_t>(QueryStage::SCORING)].buckets[0] = 1;
+    snapshot.postings_visited.count = 3;
+    snapshot.postings_visited.sum = 5;
+    snapshot.postings_visited.buckets[1] = 2;
+    snapshot.postings_visited.buckets[3] = 1;
+    snapshot.matched_documents.count = 1;
+    snapshot.matched_documents.sum = numeric_limits<uint64_t>::max();
+    snapshot.matched_documents.buckets[64] = 1;
+    ostringstream text;
+    snapshot.WriteText(text);
+    assert(text.str() == "stage_ns.parse count=0 sum=0\n"
+                         "stage_ns.minus_words count=0 sum=0\n"
+                         "stage_ns.scoring count=1 sum=0 <=0:1\n"
+                         "stage_ns.selection count=0 sum=0\n"
+                         "postings_visited count=3 sum=5 <=1:2 <=7:1\n"
+                         "matched_documents count=1 sum=18446744073709551615 <=18446744073709551615:1\n"s);
+    ostringstream json;
+    snapshot.WriteJson(json);
+    assert(json.str() == "{\"stage_ns\":{\"parse\":{\"count\":0,\"sum\":0,\"buckets\":[]},"
+                         "\"minus_words\":{\"count\":0,\"sum\":0,\"buckets\":[]},"
+                         "\"scoring\":{\"count\":1,\"sum\":0,\"buckets\":[[0,1]]},"
+                         "\"selection\":{\"count\":0,\"sum\":0,\"buckets\":[]}},"
+                         "\"postings_visited\":{\"count\":3,\"sum\":5,\"buckets\":[[1,2],[7,1]]},"
+                         "\"matched_documents\":{\"count\":1,\"sum\":18446744073709551615,"
+                         "\"buckets\":[[18446744073709551615,1]]}}"s);
+    
+    SearchServer search_server("and"s);
+    search_server.AddDocument(1, "white cat and fancy collar"s, DocumentStatus::ACTUAL, {8, -3});
+    search_server.AddDocument(2, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, {7, 2, 7});
+    search_server.AddDocument(3, "groomed dog expressive eyes"s, DocumentStatus::ACTUAL, {5, -12, 2, 1});
+    search_server.FindTopDocuments("cat -dog"s);
+    // Answered from the cache
+    search_server.FindTopDocuments("cat -dog"s);
+    search_server.MatchDocument("cat"s, 1);
+    search_server.SetScoringMode(ScoringMode::WAND);
+    search_server.FindTopDocuments("cat tail"s);
+    
+    const QueryStatsSnapshot stats = search_server.GetQueryStats();
+    const auto get_stage = [&stats](QueryStage stage) {
+        return stats.stage_nanoseconds[static_cast<size_t>(stage)];
+    };
+#ifdef SEARCH_SERVER_STATS
+    assert(get_stage(QueryStage::PARSE).count == 4);
+    assert(get_stage(QueryStage::MINUS_WORDS).count == 2);
+    assert(get_stage(QueryStage::SCORING).count == 2);
+    assert(get_stage(QueryStage::SELECTION).count == 2);
+    assert(stats.matched_documents.count == 2);
+    assert(stats.matched_documents.sum == 4);
+    // The exhaustive query visits both postings of "cat", WAND also the posting of "tail"
+    assert(stats.postings_visited.count == 2);
+    assert(stats.postings_visited.sum == 5);
+    uint64_t histogram_sum = 0;
+    for (const uint64_t bucket_count : stats.postings_visited.buckets) {
+        histogram_sum += bucket_count;
+    }
+    assert(histogram_sum == stats.postings_visited.count);
+#else
+    for (const QueryStage stage : {QueryStage::PARSE, QueryStage::MINUS_WORDS, QueryStage::SCORING, QueryStage::SELECTION}) {
+        assert(get_stage(stage).count == 0);
+    }
+    assert(stats.postings_visited.count == 0 && stats.matched_documents.count == 0);
+#endif
+    
+    search_server.ResetQueryStats();
+    const QueryStatsSnapshot reset_stats = search_server.GetQueryStats();
+    assert(reset_stats.stage_nanoseconds[static_cast<size_t>(QueryStage::PARSE)].count == 0);
+    assert(reset_stats.postings_visited.count == 0 && reset_stats.postings_visited.sum == 0);
+}
+
+// 16. Everything the index keeps comes from the pool of the server, whose chunks are allocated with
+// aligned operator new: adding and removing documents leaves no other allocations alive
+void TestIndexAllocatesFromItsPool() {
+    mt19937 generator(16);
+    vector<string> texts;
+    for (int i = 0; i < 4000; ++i) {
+        texts.push_back(MakeText(generator, i < 3000 ? 400 : 50, 30));
+    }
+    SearchServer search_server("w0"s);
+    const int64_t allocation_count = live_allocation_count;
+    for (int document_id = 0; document_id < 3000; ++document_id) {
+        search_server.AddDocument(document_id, texts[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    assert(live_allocation_count == allocation_count);
+    // Removing most documents compacts the ordinals, which rebuilds every posting list
+    for (int document_id = 0; document_id < 3000; ++document_id) {
+        if (document_id % 3 != 0) {
+            search_server.RemoveDocument(document_id);
+        }
+    }
+    for (int document_id = 3000; document_id < 4000; ++document_id) {
+        search_server.AddDocument(document_id, texts[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    assert(live_allocation_count == allocation_count);
+    assert(!search_server.FindTopDocuments("w2 w3 w4 -w5"s).empty());
+}
+
+// Entry point of the search server tests
+void TestSearchServer() {
+    TestCompressedPostingsAddAndErase();
+    TestWandMatchesExhaustive();
+    TestSaveAndOpenIndex();
+    TestAddDocumentsErrorsMatchAddDocument();
+    TestProcessQueries();
+    TestForEachWordMatchesByteByByteScan();
+    TestRemoveDocument();
+    TestRemoveDuplicates();
+    TestQueryCache();
+    TestRequestQueue();
+    TestDocumentIdBitmap();
+    TestMatchDocumentPolicies();
+    TestSpecializedPredicatesMatchLambdas();
+    TestStopWordSet();
+    TestQueryStats();
+    TestIndexAllocatesFromItsPool();
+}
+
+// --------- End of unit tests of the search server -----------
+
+int main() {
+    TestSearchServer();
+    // If you see this line, all tests have passed
+    cout << "Search server testing finished"s << endl;
+}
@@ -0,0 +1,330 @@
+// Benchmark of SearchServer on synthetic corpora whose words follow a Zipf distribution.
+// Build: g++ -std=c++17 -O2 search_server_benchmark.cpp -o search_server_benchmark -ltbb -lpthread
+// Run:   ./search_server_benchmark [documents=1000,10000,50000] [words=50] [vocabulary=20000]
+//                                  [zipf=1.0] [stop_words=10] [queries=100] [seed=42]
+// Results are written to stdout as CSV, latencies are in microseconds. The same seed
+// always produces the same corpora and queries.
+
+#define SEARCH_SERVER_NO_MAIN
+#include "search_server_and_paginator.cpp"
+
+#include <filesystem>
+#include <random>
+
+struct BenchmarkConfig {
+    vector<int> document_counts = {1000, 10000, 50000};
+    int words_per_document = 50;
+    int vocabulary_size = 20000;
+    double zipf_exponent = 1.0;
+    int stop_word_count = 10;
+    int query_count = 100;
+    uint32_t seed = 42;
+};
+
+const vector<int> QUERY_WORD_COUNTS = {1, 2, 4, 8};
+const vector<double> MINUS_WORD_RATIOS = {0.0, 0.25, 0.5};
+const int INDEX_FILE_REPETITIONS = 3;
+
+// Samples ranks 0..size-1 with probabilities proportional to 1 / (rank + 1)^exponent
+class ZipfDistribution {
+public:
+    ZipfDistribution(int size, double exponent) {
+        double sum = 0.0;
+        cumulative_weights_.reserve(size);
+        for (int rank = 0; rank < size; ++rank) {
+            sum += 1.0 / pow(rank + 1.0, exponent);
+            cumulative_weights_.push_back(sum);
+        }
+    }
+    
+    template <typename Generator>
+    int operator()(Generator& generator) const {
+        uniform_real_distribution<double> distribution(0.0, cumulative_weights_.back());
+        const auto it = upper_bound(cumulative_weights_.begin(), cumulative_weights_.end(), distribution(generator));
+        return static_cast<int>(min(it - cumulative_weights_.begin(), static_cast<ptrdiff_t>(cumulative_weights_.size() - 1)));
+    }
+
+private:
+    vector<double> cumulative_weights_;
+};
+
+// Distinct lowercase word for every rank: a, b, ..., z, aa, ab, ...
+string MakeWord(int rank) {
+    string word;
+    for (int value = rank + 1; value > 0; value = (value - 1) / 26) {
+        word += static_cast<char>('a' + (value - 1) % 26);
+    }
+    return word;
+}
+
+class CorpusGenerator {
+public:
+    explicit CorpusGenerator(const BenchmarkConfig& config)
+            : config_(config)
+            , words_(config.vocabulary_size, config.zipf_exponent)
+            , generator_(config.seed) {
+    }
+    
+    // The most frequent words are the stop words, just like in natural language
+    string MakeStopWords() const {
+        string stop_words;
+        for (int rank = 0; rank < config_.stop_word_count; ++rank) {
+            stop_words += MakeWord(rank) + " "s;
+        }
+        return stop_words;
+    }
+    
+    string MakeDocument() {
+        uniform_int_distribution<int> length(config_.words_per_document / 2, config_.words_per_document * 3 / 2);
+        string document;
+        for (int i = length(generator_); i > 0; --i) {
+            document += MakeWord(words_(generator_)) + " "s;
+        }
+        return document;
+    }
+    
+    vector<int> MakeRatings() {
+        uniform_int_distribution<int> count(1, 5);
+        uniform_int_distribution<int> rating(-10, 10);
+        vector<int> ratings(count(generator_));
+        for (int& value : ratings) {
+            value = rating(generator_);
+        }
+        return ratings;
+    }
+    
+    // Stop words are skipped, so every query has exactly word_count meaningful words
+    string MakeQuery(int word_count, double minus_word_ratio) {
+        bernoulli_distribution is_minus_word(minus_word_ratio);
+        string query;
+        for (int i = 0; i < word_count; ++i) {
+            int rank = words_(generator_);
+            while (rank < config_.stop_word_count) {
+                rank = words_(generator_);
+            }
+            query += (is_minus_word(generator_) ? "-"s : ""s) + MakeWord(rank) + " "s;
+        }
+        return query;
+    }
+    
+    int MakeDocumentId(int document_count) {
+        return uniform_int_distribution<int>(0, document_count - 1)(generator_);
+    }
+
+private:
+    const BenchmarkConfig& config_;
+    ZipfDistribution words_;
+    mt19937 generator_;
+};
+
+struct LatencySummary {
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+};
+
+LatencySummary Summarize(vector<double> latencies) {
+    LatencySummary summary;
+    if (latencies.empty()) {
+        return summary;
+    }
+    sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double fraction) {
+        return latencies[min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()))];
+    };
+    summary.mean = accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+    summary.p50 = percentile(0.5);
+    summary.p90 = percentile(0.9);
+    summary.p99 = percentile(0.99);
+    return summary;
+}
+
+template <typename Operation>
+double MeasureMicroseconds(Operation operation) {
+    const auto start = chrono::steady_clock::now();
+    operation();
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+void PrintHeader() {
+    cout << "benchmark,documents,query_words,minus_ratio,mode,operations,"s
+         << "mean_us,p50_us,p90_us,p99_us,operations_per_second"s << endl;
+}
+
+// Throughput counts the measured time only, without generating the input
+void PrintRow(string_view benchmark, int document_count, int query_word_count, double minus_word_ratio,
+              string_view mode, const vector<double>& latencies) {
+    const LatencySummary summary = Summarize(latencies);
+    const double total_microseconds = accumulate(latencies.begin(), latencies.end(), 0.0);
+    cout << benchmark << ","s << document_count << ","s << query_word_count << ","s << minus_word_ratio << ","s
+         << mode << ","s << latencies.size() << ","s << summary.mean << ","s << summary.p50 << ","s
+         << summary.p90 << ","s << summary.p99 << ","s
+         << (total_microseconds > 0.0 ? latencies.size() * 1e6 / total_microseconds : 0.0) << endl;
+}
+
+// Checksum of all results, printed at the end so the measured calls cannot be optimized away
+size_t result_checksum = 0;
+
+SearchServer BenchmarkAddDocument(CorpusGenerator& corpus, int document_count) {
+    SearchServer search_server(corpus.MakeStopWords());
+    // Repeated queries must be scored every time
+    search_server.SetQueryCacheCapacity(0);
+    vector<double> latencies;
+    latencies.reserve(document_count);
+    for (int document_id = 0; document_id < document_count; ++document_id) {
+        const string document = corpus.MakeDocument();
+        const vector<int> ratings = corpus.MakeRatings();
+        latencies.push_back(MeasureMicroseconds([&] {
+            search_server.AddDocument(document_id, document, DocumentStatus::ACTUAL, ratings);
+        }));
+    }
+    PrintRow("add_document"sv, document_count, 0, 0.0, "seq"sv, latencies);
+    return search_server;
+}
+
+void BenchmarkFindTopDocuments(const BenchmarkConfig& config, CorpusGenerator& corpus, SearchServer& search_server) {
+    const int document_count = search_server.GetDocumentCount();
+    for (const int query_word_count : QUERY_WORD_COUNTS) {
+        for (const double minus_word_ratio : MINUS_WORD_RATIOS) {
+            vector<string> queries;
+            for (int i = 0; i < config.query_count; ++i) {
+                queries.push_back(corpus.MakeQuery(query_word_count, minus_word_ratio));
+            }
+            vector<double> exhaustive_latencies;
+            vector<double> wand_latencies;
+            vector<double> parallel_latencies;
+            for (const string& query : queries) {
+                search_server.SetScoringMode(ScoringMode::EXHAUSTIVE);
+                exhaustive_latencies.push_back(MeasureMicroseconds([&] {
+                    result_checksum += search_server.FindTopDocuments(query).size();
+                }));
+                search_server.SetScoringMode(ScoringMode::WAND);
+                wand_latencies.push_back(MeasureMicroseconds([&] {
+                    result_checksum += search_server.FindTopDocuments(query).size();
+                }));
+                parallel_latencies.push_back(MeasureMicroseconds([&] {
+                    result_checksum += search_server.FindTopDocuments(execution::par, query).size();
+                }));
+            }
+            search_server.SetScoringMode(ScoringMode::EXHAUSTIVE);
+            PrintRow("find_top_documents"sv, document_count, query_word_count, minus_word_ratio, "seq"sv,
+                     exhaustive_latencies);
+            PrintRow("find_top_documents"sv, document_count, query_word_count, minus_word_ratio, "seq_wand"sv,
+                     wand_latencies);
+            PrintRow("find_top_documents"sv, document_count, query_word_count, minus_word_ratio, "par"sv,
+                     parallel_latencies);
+        }
+    }
+}
+
+void BenchmarkMatchDocument(const BenchmarkConfig& config, CorpusGenerator& corpus, const SearchServer& search_server) {
+    const int document_count = search_server.GetDocumentCount();
+    for (const int query_word_count : QUERY_WORD_COUNTS) {
+        vector<double> sequential_latencies;
+        vector<double> parallel_latencies;
+        for (int i = 0; i < config.query_count; ++i) {
+            const string query = corpus.MakeQuery(query_word_count, 0.0);
+            const int document_id = corpus.MakeDocumentId(document_count);
+            sequential_latencies.push_back(MeasureMicroseconds([&] {
+                result_checksum += get<0>(search_server.MatchDocument(execution::seq, query, document_id)).size();
+            }));
+            parallel_latencies.push_back(MeasureMicroseconds([&] {
+                result_checksum += get<0>(search_server.MatchDocument(execution::par, query, document_id)).size();
+            }));
+        }
+        PrintRow("match_document"sv, document_count, query_word_count, 0.0, "seq"sv, sequential_latencies);
+        PrintRow("match_document"sv, document_count, query_word_count, 0.0, "par"sv, parallel_latencies);
+    }
+}
+
+// Cold start from a saved index. open_index should stay well below the total time of add_document
+// for the same corpus; the document words that OpenIndex leaves out are measured separately
+// as they are collected by the first call that needs them.
+void BenchmarkOpenIndex(const SearchServer& search_server) {
+    const int document_count = search_server.GetDocumentCount();
+    const string path = (filesystem::temp_directory_path() / "search_server_benchmark.index"s).string();
+    vector<double> save_latencies;
+    vector<double> open_latencies;
+    vector<double> load_words_latencies;
+    for (int i = 0; i < INDEX_FILE_REPETITIONS; ++i) {
+        save_latencies.push_back(MeasureMicroseconds([&] {
+            search_server.SaveIndex(path);
+        }));
+        optional<SearchServer> opened_server;
+        open_latencies.push_back(MeasureMicroseconds([&] {
+            opened_server.emplace(SearchServer::OpenIndex(path));
+        }));
+        load_words_latencies.push_back(MeasureMicroseconds([&] {
+            result_checksum += opened_server->GetWordFrequencies(*opened_server->begin()).size();
+        }));
+    }
+    filesystem::remove(path);
+    PrintRow("save_index"sv, document_count, 0, 0.0, "seq"sv, save_latencies);
+    PrintRow("open_index"sv, document_count, 0, 0.0, "seq"sv, open_latencies);
+    PrintRow("open_index_first_word_frequencies"sv, document_count, 0, 0.0, "seq"sv, load_words_latencies);
+}
+
+// Arguments look like name=value, documents takes a comma-separated list
+BenchmarkConfig ParseArguments(int argc, char* argv[]) {
+    BenchmarkConfig config;
+    for (int i = 1; i < argc; ++i) {
+        const string_view argument = argv[i];
+        const size_t separator = argument.find('=');
+        if (separator == string_view::npos) {
+            throw invalid_argument("Expected name=value instead of "s + string(argument));
+        }
+        const string_view name = argument.substr(0, separator);
+        const string value(argument.substr(separator + 1));
+        if (name == "documents"sv) {
+            config.document_counts.clear();
+            for (size_t begin = 0; begin <= value.size();) {
+                const size_t end = min(value.find(',', begin), value.size());
+                config.document_counts.push_back(stoi(value.substr(begin, end - begin)));
+                begin = end + 1;
+            }
+        } else if (name == "words"sv) {
+            config.words_per_document = stoi(value);
+        } else if (name == "vocabulary"sv) {
+            config.vocabulary_size = stoi(value);
+        } else if (name == "zipf"sv) {
+            config.zipf_exponent = stod(value);
+        } else if (name == "stop_words"sv) {
+            config.stop_word_count = stoi(value);
+        } else if (name == "queries"sv) {
+            config.query_count = stoi(value);
+        } else if (name == "seed"sv) {
+            config.seed = static_cast<uint32_t>(stoul(value));
+        } else {
+            throw invalid_argument("Unknown argument "s + string(name));
+        }
+    }
+    if (config.document_counts.empty() || config.words_per_document < 1 || config.query_count < 1
+        || config.stop_word_count < 0 || config.vocabulary_size <= config.stop_word_count
+        || any_of(config.document_counts.begin(), config.document_counts.end(), [](int count) { return count < 1; })) {
+        throw invalid_argument("Invalid benchmark configuration"s);
+    }
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkConfig config;
+    try {
+        config = ParseArguments(argc, argv);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        cerr << "Usage: "s << argv[0] << " [documents=1000,10000,50000] [words=50] [vocabulary=20000]"s
+             << " [zipf=1.0] [stop_words=10] [queries=100] [seed=42]"s << endl;
+        return 1;
+    }
+    
+    PrintHeader();
+    for (const int document_count : config.document_counts) {
+        CorpusGenerator corpus(config);
+        SearchServer search_server = BenchmarkAddDocument(corpus, document_count);
+        BenchmarkFindTopDocuments(config, corpus, search_server);
+        BenchmarkMatchDocument(config, corpus, search_server);
+        BenchmarkOpenIndex(search_server);
+    }
+    cerr << "Checksum: "s << result_checksum << endl;
+}